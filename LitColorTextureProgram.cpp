@@ -5,6 +5,46 @@
 
 Scene::Drawable::Pipeline lit_color_texture_program_pipeline;
 
+//lighting fragment shader shared by the instanced and non-instanced programs:
+static char const *lit_color_texture_fragment_shader =
+	"#version 330\n"
+	"uniform sampler2D TEX;\n"
+	"uniform int LIGHT_TYPE;\n"
+	"uniform vec3 LIGHT_LOCATION;\n"
+	"uniform vec3 LIGHT_DIRECTION;\n"
+	"uniform vec3 LIGHT_ENERGY;\n"
+	"uniform float LIGHT_CUTOFF;\n"
+	"in vec3 position;\n"
+	"in vec3 normal;\n"
+	"in vec4 color;\n"
+	"in vec2 texCoord;\n"
+	"out vec4 fragColor;\n"
+	"void main() {\n"
+	"	vec3 n = normalize(normal);\n"
+	"	vec3 e;\n"
+	"	if (LIGHT_TYPE == 0) { //point light \n"
+	"		vec3 l = (LIGHT_LOCATION - position);\n"
+	"		float dis2 = dot(l,l);\n"
+	"		l = normalize(l);\n"
+	"		float nl = max(0.0, dot(n, l)) / max(1.0, dis2);\n"
+	"		e = nl * LIGHT_ENERGY;\n"
+	"	} else if (LIGHT_TYPE == 1) { //hemi light \n"
+	"		e = (dot(n,-LIGHT_DIRECTION) * 0.5 + 0.5) * LIGHT_ENERGY;\n"
+	"	} else if (LIGHT_TYPE == 2) { //spot light \n"
+	"		vec3 l = (LIGHT_LOCATION - position);\n"
+	"		float dis2 = dot(l,l);\n"
+	"		l = normalize(l);\n"
+	"		float nl = max(0.0, dot(n, l)) / max(1.0, dis2);\n"
+	"		float c = dot(l,-LIGHT_DIRECTION);\n"
+	"		nl *= smoothstep(LIGHT_CUTOFF,mix(LIGHT_CUTOFF,1.0,0.1), c);\n"
+	"		e = nl * LIGHT_ENERGY;\n"
+	"	} else { //(LIGHT_TYPE == 3) //directional light \n"
+	"		e = max(0.0, dot(n,-LIGHT_DIRECTION)) * LIGHT_ENERGY;\n"
+	"	}\n"
+	"	vec4 albedo = texture(TEX, texCoord) * color;\n"
+	"	fragColor = vec4(e*albedo.rgb, albedo.a);\n"
+	"}\n";
+
 Load< LitColorTextureProgram > lit_color_texture_program(LoadTagEarly, []() -> LitColorTextureProgram const * {
 	LitColorTextureProgram *ret = new LitColorTextureProgram();
 
@@ -68,43 +108,7 @@ LitColorTextureProgram::LitColorTextureProgram() {
 		"}\n"
 	,
 		//fragment shader:
-		"#version 330\n"
-		"uniform sampler2D TEX;\n"
-		"uniform int LIGHT_TYPE;\n"
-		"uniform vec3 LIGHT_LOCATION;\n"
-		"uniform vec3 LIGHT_DIRECTION;\n"
-		"uniform vec3 LIGHT_ENERGY;\n"
-		"uniform float LIGHT_CUTOFF;\n"
-		"in vec3 position;\n"
-		"in vec3 normal;\n"
-		"in vec4 color;\n"
-		"in vec2 texCoord;\n"
-		"out vec4 fragColor;\n"
-		"void main() {\n"
-		"	vec3 n = normalize(normal);\n"
-		"	vec3 e;\n"
-		"	if (LIGHT_TYPE == 0) { //point light \n"
-		"		vec3 l = (LIGHT_LOCATION - position);\n"
-		"		float dis2 = dot(l,l);\n"
-		"		l = normalize(l);\n"
-		"		float nl = max(0.0, dot(n, l)) / max(1.0, dis2);\n"
-		"		e = nl * LIGHT_ENERGY;\n"
-		"	} else if (LIGHT_TYPE == 1) { //hemi light \n"
-		"		e = (dot(n,-LIGHT_DIRECTION) * 0.5 + 0.5) * LIGHT_ENERGY;\n"
-		"	} else if (LIGHT_TYPE == 2) { //spot light \n"
-		"		vec3 l = (LIGHT_LOCATION - position);\n"
-		"		float dis2 = dot(l,l);\n"
-		"		l = normalize(l);\n"
-		"		float nl = max(0.0, dot(n, l)) / max(1.0, dis2);\n"
-		"		float c = dot(l,-LIGHT_DIRECTION);\n"
-		"		nl *= smoothstep(LIGHT_CUTOFF,mix(LIGHT_CUTOFF,1.0,0.1), c);\n"
-		"		e = nl * LIGHT_ENERGY;\n"
-		"	} else { //(LIGHT_TYPE == 3) //directional light \n"
-		"		e = max(0.0, dot(n,-LIGHT_DIRECTION)) * LIGHT_ENERGY;\n"
-		"	}\n"
-		"	vec4 albedo = texture(TEX, texCoord) * color;\n"
-		"	fragColor = vec4(e*albedo.rgb, albedo.a);\n"
-		"}\n"
+		lit_color_texture_fragment_shader
 	);
 	//As you can see above, adjacent strings in C/C++ are concatenated.
 	// this is very useful for writing long shader programs inline.
@@ -142,3 +146,89 @@ LitColorTextureProgram::~LitColorTextureProgram() {
 	program = 0;
 }
 
+
+Load< InstancedLitColorTextureProgram > instanced_lit_color_texture_program(LoadTagEarly, []() -> InstancedLitColorTextureProgram const * {
+	InstancedLitColorTextureProgram *ret = new InstancedLitColorTextureProgram();
+
+	//----- add the instanced variant to the pipeline template -----
+	// (vao must still be set per-mesh-buffer, using make_vao_for_program(instanced_lit_color_texture_program->program))
+	lit_color_texture_program_pipeline.instancing.program = ret->program;
+	lit_color_texture_program_pipeline.instancing.WORLD_TO_CLIP_mat4 = ret->WORLD_TO_CLIP_mat4;
+	lit_color_texture_program_pipeline.instancing.WORLD_TO_LIGHT_mat4x3 = ret->WORLD_TO_LIGHT_mat4x3;
+	lit_color_texture_program_pipeline.instancing.INSTANCE_BASE_int = ret->INSTANCE_BASE_int;
+
+	return ret;
+});
+
+InstancedLitColorTextureProgram::InstancedLitColorTextureProgram() {
+	program = gl_compile_program(
+		//vertex shader:
+		// (per-instance matrices are fetched from a buffer texture; see Scene::Drawable::Pipeline::Instancing)
+		"#version 330\n"
+		"uniform mat4 WORLD_TO_CLIP;\n"
+		"uniform mat4x3 WORLD_TO_LIGHT;\n"
+		"uniform int INSTANCE_BASE;\n"
+		"uniform samplerBuffer INSTANCES;\n"
+		"in vec4 Position;\n"
+		"in vec3 Normal;\n"
+		"in vec4 Color;\n"
+		"in vec2 TexCoord;\n"
+		"out vec3 position;\n"
+		"out vec3 normal;\n"
+		"out vec4 color;\n"
+		"out vec2 texCoord;\n"
+		"void main() {\n"
+		"	int base = (INSTANCE_BASE + gl_InstanceID) * 6;\n"
+		"	vec4 world = vec4(\n"
+		"		dot(texelFetch(INSTANCES, base+0), Position),\n"
+		"		dot(texelFetch(INSTANCES, base+1), Position),\n"
+		"		dot(texelFetch(INSTANCES, base+2), Position),\n"
+		"		Position.w\n"
+		"	);\n"
+		"	gl_Position = WORLD_TO_CLIP * world;\n"
+		"	position = WORLD_TO_LIGHT * world;\n"
+		"	normal = vec3(\n"
+		"		dot(texelFetch(INSTANCES, base+3).xyz, Normal),\n"
+		"		dot(texelFetch(INSTANCES, base+4).xyz, Normal),\n"
+		"		dot(texelFetch(INSTANCES, base+5).xyz, Normal)\n"
+		"	);\n"
+		"	color = Color;\n"
+		"	texCoord = TexCoord;\n"
+		"}\n"
+	,
+		//fragment shader:
+		lit_color_texture_fragment_shader
+	);
+
+	//look up the locations of vertex attributes:
+	Position_vec4 = glGetAttribLocation(program, "Position");
+	Normal_vec3 = glGetAttribLocation(program, "Normal");
+	Color_vec4 = glGetAttribLocation(program, "Color");
+	TexCoord_vec2 = glGetAttribLocation(program, "TexCoord");
+
+	//look up the locations of uniforms:
+	WORLD_TO_CLIP_mat4 = glGetUniformLocation(program, "WORLD_TO_CLIP");
+	WORLD_TO_LIGHT_mat4x3 = glGetUniformLocation(program, "WORLD_TO_LIGHT");
+	INSTANCE_BASE_int = glGetUniformLocation(program, "INSTANCE_BASE");
+
+	LIGHT_TYPE_int = glGetUniformLocation(program, "LIGHT_TYPE");
+	LIGHT_LOCATION_vec3 = glGetUniformLocation(program, "LIGHT_LOCATION");
+	LIGHT_DIRECTION_vec3 = glGetUniformLocation(program, "LIGHT_DIRECTION");
+	LIGHT_ENERGY_vec3 = glGetUniformLocation(program, "LIGHT_ENERGY");
+	LIGHT_CUTOFF_float = glGetUniformLocation(program, "LIGHT_CUTOFF");
+
+	GLuint TEX_sampler2D = glGetUniformLocation(program, "TEX");
+	GLuint INSTANCES_samplerBuffer = glGetUniformLocation(program, "INSTANCES");
+
+	glUseProgram(program);
+
+	glUniform1i(TEX_sampler2D, 0); //set TEX to sample from GL_TEXTURE0
+	glUniform1i(INSTANCES_samplerBuffer, Scene::Drawable::Pipeline::TextureCount); //Scene::draw binds instance data after the drawable's textures
+
+	glUseProgram(0);
+}
+
+InstancedLitColorTextureProgram::~InstancedLitColorTextureProgram() {
+	glDeleteProgram(program);
+	program = 0;
+}
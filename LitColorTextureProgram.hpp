@@ -35,6 +35,39 @@ struct LitColorTextureProgram {
 
 extern Load< LitColorTextureProgram > lit_color_texture_program;
 
+//Instanced variant of the above; per-instance matrices come from a buffer texture filled by Scene::draw:
+struct InstancedLitColorTextureProgram {
+	InstancedLitColorTextureProgram();
+	~InstancedLitColorTextureProgram();
+
+	GLuint program = 0;
+
+	//Attribute (per-vertex variable) locations:
+	GLuint Position_vec4 = -1U;
+	GLuint Normal_vec3 = -1U;
+	GLuint Color_vec4 = -1U;
+	GLuint TexCoord_vec2 = -1U;
+
+	//Uniform (per-invocation variable) locations:
+	GLuint WORLD_TO_CLIP_mat4 = -1U;
+	GLuint WORLD_TO_LIGHT_mat4x3 = -1U;
+	GLuint INSTANCE_BASE_int = -1U;
+
+	//lighting:
+	GLuint LIGHT_TYPE_int = -1U;
+	GLuint LIGHT_LOCATION_vec3 = -1U;
+	GLuint LIGHT_DIRECTION_vec3 = -1U;
+	GLuint LIGHT_ENERGY_vec3 = -1U;
+	GLuint LIGHT_CUTOFF_float = -1U;
+
+	//Textures:
+	//TEXTURE0 - texture that is accessed by TexCoord
+	//TEXTURE4 - (buffer texture) per-instance matrices
+};
+
+extern Load< InstancedLitColorTextureProgram > instanced_lit_color_texture_program;
+
 //For convenient scene-graph setup, copy this object:
 // NOTE: by default, has texture bound to 1-pixel white texture -- so it's okay to use with vertex-color-only meshes.
+// NOTE: instancing.vao must be set along with vao for drawables to be instanced.
 extern Scene::Drawable::Pipeline lit_color_texture_program_pipeline;
@@ -1,20 +1,54 @@
 #include "Load.hpp"
 
+#include <algorithm>
 #include <array>
-#include <list>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <list>
+#include <thread>
+#include <vector>
 
 namespace {
-	std::array< std::list< std::function< void() > >, MaxLoadTag > &get_load_lists() {
-		static std::array< std::list< std::function< void() > >, MaxLoadTag > load_lists;
+	struct LoadFunction {
+		std::function< void() > fn;
+		LoadThread thread = LoadOnMainThread;
+		std::string name;
+
+		//filled in by call_load_functions():
+		double ms = 0.0; //time taken to run 'fn'
+		bool on_worker = false; //did 'fn' run on a worker thread?
+		std::exception_ptr error; //exception thrown by 'fn', if any
+	};
+
+	std::array< std::list< LoadFunction >, MaxLoadTag > &get_load_lists() {
+		static std::array< std::list< LoadFunction >, MaxLoadTag > load_lists;
 		return load_lists;
 	}
+
+	//helper: run a loading function, recording time taken and any exception thrown:
+	void run(LoadFunction &load, bool on_worker) {
+		auto before = std::chrono::high_resolution_clock::now();
+		try {
+			load.fn();
+		} catch (...) {
+			load.error = std::current_exception();
+		}
+		auto after = std::chrono::high_resolution_clock::now();
+		load.ms = std::chrono::duration< double >(after - before).count() * 1000.0;
+		load.on_worker = on_worker;
+	}
 }
 
-void add_load_function(LoadTag tag, std::function< void() > const &fn) {
+void add_load_function(LoadTag tag, std::function< void() > const &fn, LoadThread thread, std::string const &name) {
 	auto &load_lists = get_load_lists();
 	assert(tag < load_lists.size());
-	load_lists[tag].emplace_back(fn);
+	load_lists[tag].emplace_back();
+	load_lists[tag].back().fn = fn;
+	load_lists[tag].back().thread = thread;
+	load_lists[tag].back().name = name;
 }
 
 void call_load_functions() {
@@ -22,11 +56,61 @@ void call_load_functions() {
 	assert(!has_been_called && "call_load_functions should only be called *once*");
 	has_been_called = true;
 
+	auto total_before = std::chrono::high_resolution_clock::now();
+
 	auto &load_lists = get_load_lists();
 	for (auto &fn_list : load_lists) {
-		while (!fn_list.empty()) {
-			(*fn_list.begin())(); //call first function in the list
-			fn_list.pop_front(); //remove from list
+		//split into functions that need the main thread and those that can go anywhere:
+		std::vector< LoadFunction * > main_loads, any_loads;
+		for (auto &load : fn_list) {
+			if (load.thread == LoadOnAnyThread) any_loads.emplace_back(&load);
+			else main_loads.emplace_back(&load);
+		}
+
+		//worker threads pull from 'any_loads' until it runs out:
+		std::atomic< uint32_t > next_any(0);
+		auto run_any = [&](bool on_worker) {
+			for (uint32_t i = next_any++; i < any_loads.size(); i = next_any++) {
+				run(*any_loads[i], on_worker);
+			}
+		};
+
+		std::vector< std::thread > workers;
+		uint32_t worker_count = std::min(uint32_t(any_loads.size()), std::max(1U, std::thread::hardware_concurrency()) - 1);
+		for (uint32_t w = 0; w < worker_count; ++w) {
+			workers.emplace_back(run_any, true);
+		}
+
+		//main thread runs its own functions in order, then helps out with the rest:
+		for (auto load : main_loads) {
+			run(*load, false);
+		}
+		run_any(false);
+
+		for (auto &worker : workers) {
+			worker.join();
+		}
+
+		//report the first failure (in the order functions were added):
+		for (auto &load : fn_list) {
+			if (load.error) std::rethrow_exception(load.error);
+		}
+	}
+
+	auto total_after = std::chrono::high_resolution_clock::now();
+
+	//report timing:
+	std::cout << "Loading took " << std::chrono::duration< double >(total_after - total_before).count() * 1000.0 << " ms:\n";
+	for (uint32_t tag = 0; tag < load_lists.size(); ++tag) {
+		for (auto const &load : load_lists[tag]) {
+			std::cout << "  [tag " << tag << "] " << (load.name.empty() ? "(unnamed)" : load.name)
+			          << ": " << load.ms << " ms" << (load.on_worker ? " (worker thread)" : "") << "\n";
 		}
 	}
+	std::cout.flush();
+
+	//free loading functions (and anything they captured):
+	for (auto &fn_list : load_lists) {
+		fn_list.clear();
+	}
 }
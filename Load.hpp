@@ -20,10 +20,16 @@
  * These functions are grouped by 'tags', which allow some sequencing of calls.
  * (particularly, this is useful for loading large data blobs [e.g. Meshes] before looking up individual elements within them.)
  *
+ * Loading functions that don't touch OpenGL (e.g., that just read files or decode audio) can be marked
+ * LoadOnAnyThread; these run on a pool of worker threads while the main thread works through the rest.
+ * All functions with one tag finish before any function with a later tag starts.
+ * (functions on worker threads should not depend on other functions with the *same* tag)
+ *
  */
 
 #include <functional>
 #include <stdexcept>
+#include <string>
 
 enum LoadTag : uint32_t {
 	LoadTagEarly,
@@ -32,13 +38,20 @@ enum LoadTag : uint32_t {
 	MaxLoadTag //<-- just used to track # of load tags
 };
 
+enum LoadThread : uint32_t {
+	LoadOnMainThread, //function may use OpenGL, so must run on the main thread (the default)
+	LoadOnAnyThread, //function does CPU work only, so may run on a worker thread
+};
+
 //Add a function to an internal list of loading functions:
 // (only call *before* "call_load_functions()")
-void add_load_function(LoadTag tag, std::function< void() > const &fn);
+// (the optional 'name' is used when reporting load times)
+void add_load_function(LoadTag tag, std::function< void() > const &fn, LoadThread thread = LoadOnMainThread, std::string const &name = "");
 
 //Call all loading functions:
 // (loading functions may throw exceptions if they fail.)
 // (only call *once*)
+// (prints the time taken by each loading function when done)
 void call_load_functions();
 
 
@@ -49,13 +62,13 @@ T const *new_T() { return new T; }
 template< typename T >
 struct Load {
 	//Constructing a Load< T > adds the passed function to the list of functions to call:
-	Load(LoadTag tag, const std::function< T const *() > &load_fn = new_T< T >) : value(nullptr) {
+	Load(LoadTag tag, const std::function< T const *() > &load_fn = new_T< T >, LoadThread thread = LoadOnMainThread, std::string const &name = "") : value(nullptr) {
 		add_load_function(tag, [this,load_fn](){
 			this->value = load_fn();
 			if (!(this->value)) {
 				throw std::runtime_error("Loading failed.");
 			}
-		});
+		}, thread, name);
 	}
 
 	//Make a "Load< T >" behave like a "T const *":
@@ -73,8 +86,8 @@ struct Load {
 template< >
 struct Load< void > {
 	//Constructing a Load< T > adds the passed function to the list of functions to call:
-	Load( LoadTag tag, const std::function< void() > &load_fn) {
-		add_load_function(tag, load_fn);
+	Load( LoadTag tag, const std::function< void() > &load_fn, LoadThread thread = LoadOnMainThread, std::string const &name = "") {
+		add_load_function(tag, load_fn, thread, name);
 	}
 };
 
@@ -0,0 +1,32 @@
+#pragma once
+
+/*
+ * A MappedFile is a read-only view of the entire contents of a file,
+ * memory-mapped so that no bytes are copied until they are touched.
+ *
+ * Used (with ChunkReader from read_write_chunk.hpp) to load meshes and scenes
+ * without reading every chunk into a temporary std::vector first.
+ *
+ */
+
+#include <string>
+#include <cstddef>
+
+struct MappedFile {
+	//map a file; throws if the file can't be opened or mapped:
+	MappedFile(std::string const &filename);
+	~MappedFile();
+
+	std::string filename;
+	char const *data = nullptr; //file contents (nullptr if file is empty)
+	size_t size = 0; //size of file, in bytes
+
+	//internals:
+	#if defined(_WIN32)
+	void *file_handle = nullptr;
+	void *mapping_handle = nullptr;
+	#endif
+
+	MappedFile(MappedFile const &) = delete;
+	MappedFile &operator=(MappedFile const &) = delete;
+};
@@ -1,10 +1,8 @@
 #include "Mesh.hpp"
-#include "read_write_chunk.hpp"
 
 #include <glm/glm.hpp>
 
 #include <stdexcept>
-#include <fstream>
 #include <iostream>
 #include <vector>
 #include <string>
@@ -12,9 +10,15 @@
 #include <cstddef>
 
 MeshBuffer::MeshBuffer(std::string const &filename) {
-	glGenBuffers(1, &buffer);
+	read(filename);
+	upload();
+}
 
-	std::ifstream file(filename, std::ios::binary);
+void MeshBuffer::read(std::string const &filename) {
+	//chunks are read directly out of the mapped file (no intermediate copies):
+	// (the mapping is kept until upload(), which sends the vertex chunk to OpenGL straight from it)
+	mapped.reset(new MappedFile(filename));
+	ChunkReader file(mapped->data, mapped->size);
 
 	GLuint total = 0;
 
@@ -25,16 +29,15 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 		glm::vec2 TexCoord;
 	};
 	static_assert(sizeof(Vertex) == 3*4+3*4+4*1+2*4, "Vertex is packed.");
-	std::vector< Vertex > data;
+	ChunkSpan< Vertex > data;
 
 	//read + upload data chunk:
 	if (filename.size() >= 5 && filename.substr(filename.size()-5) == ".pnct") {
 		read_chunk(file, "pnct", &data);
 
-		//upload data:
-		glBindBuffer(GL_ARRAY_BUFFER, buffer);
-		glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(Vertex), data.data(), GL_STATIC_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		//keep (a view of) data for upload():
+		vertex_data.data = reinterpret_cast< char const * >(data.begin());
+		vertex_data.count = data.size() * sizeof(Vertex);
 
 		total = GLuint(data.size()); //store total for later checks on index
 
@@ -47,7 +50,7 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 		throw std::runtime_error("Unknown file type '" + filename + "'");
 	}
 
-	std::vector< char > strings;
+	ChunkSpan< char > strings;
 	read_chunk(file, "str0", &strings);
 
 	{ //read index chunk, add to meshes:
@@ -57,7 +60,7 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 		};
 		static_assert(sizeof(IndexEntry) == 16, "Index entry should be packed");
 
-		std::vector< IndexEntry > index;
+		ChunkSpan< IndexEntry > index;
 		read_chunk(file, "idx0", &index);
 
 		for (auto const &entry : index) {
@@ -67,7 +70,7 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 			if (!(entry.vertex_begin <= entry.vertex_end && entry.vertex_end <= total)) {
 				throw std::runtime_error("index entry has out-of-range vertex start/count");
 			}
-			std::string name(&strings[0] + entry.name_begin, &strings[0] + entry.name_end);
+			std::string name(strings.begin() + entry.name_begin, strings.begin() + entry.name_end);
 			Mesh mesh;
 			mesh.type = GL_TRIANGLES;
 			mesh.start = entry.vertex_begin;
@@ -83,7 +86,7 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 		}
 	}
 
-	if (file.peek() != EOF) {
+	if (file.offset != file.size) {
 		std::cerr << "WARNING: trailing data in mesh file '" << filename << "'" << std::endl;
 	}
 
@@ -98,6 +101,19 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 	*/
 }
 
+void MeshBuffer::upload() {
+	assert(buffer == 0 && "MeshBuffer should only be uploaded once.");
+	glGenBuffers(1, &buffer);
+
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glBufferData(GL_ARRAY_BUFFER, vertex_data.size(), vertex_data.begin(), GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	//data now lives in the buffer, so the file can be unmapped:
+	vertex_data = ChunkSpan< char >();
+	mapped.reset();
+}
+
 const Mesh &MeshBuffer::lookup(std::string const &name) const {
 	auto f = meshes.find(name);
 	if (f == meshes.end()) {
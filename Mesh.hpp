@@ -10,10 +10,14 @@
  */
 
 #include "GL.hpp"
+#include "MappedFile.hpp"
+#include "read_write_chunk.hpp"
 #include <glm/glm.hpp>
 #include <map>
+#include <memory>
 #include <limits>
 #include <string>
+#include <vector>
 
 
 struct Mesh {
@@ -34,6 +38,13 @@ struct MeshBuffer {
 	// note: will throw if file fails to read.
 	MeshBuffer(std::string const &filename);
 
+	//..or construct in two steps, so that the file can be read off the main thread:
+	// read() parses the file without touching OpenGL (so can run on any thread; throws if file fails to read),
+	// and upload() then creates 'buffer' straight from the file's mapping (so must run on the main thread).
+	MeshBuffer() = default;
+	void read(std::string const &filename);
+	void upload();
+
 	//look up a particular mesh by name:
 	// note: will throw if mesh not found.
 	const Mesh &lookup(std::string const &name) const;
@@ -50,6 +61,10 @@ struct MeshBuffer {
 	//used by the lookup() function:
 	std::map< std::string, Mesh > meshes;
 
+	//the file mapped by read() and its vertex chunk, held until upload():
+	std::unique_ptr< MappedFile > mapped;
+	ChunkSpan< char > vertex_data;
+
 	//These 'Attrib' structures describe the location of various attributes within the buffer (in exactly format wanted by glVertexAttribPointer). They are set when the file is loaded and are used by the "make_vao_for_program" call:
 	struct Attrib {
 		GLint size = 0;
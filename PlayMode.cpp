@@ -13,15 +13,36 @@
 #include <random>
 #include <iostream>
 
+//the mesh and scene files are read and parsed on worker threads; only the OpenGL upload (and the
+// drawables that refer to the uploaded meshes) wait for the main thread, in a later tag:
+MeshBuffer *musicmurdermystery_mesh_data = nullptr;
+Load< void > read_musicmurdermystery_meshes(LoadTagDefault, [](){
+	musicmurdermystery_mesh_data = new MeshBuffer();
+	musicmurdermystery_mesh_data->read(data_path("musicmurdermystery.pnct"));
+}, LoadOnAnyThread, "musicmurdermystery.pnct");
+
 GLuint musicmurdermystery_meshes_for_lit_color_texture_program = 0;
-Load< MeshBuffer > musicmurdermystery_meshes(LoadTagDefault, []() -> MeshBuffer const * {
-	MeshBuffer const *ret = new MeshBuffer(data_path("musicmurdermystery.pnct"));
+GLuint musicmurdermystery_meshes_for_instanced_lit_color_texture_program = 0;
+Load< MeshBuffer > musicmurdermystery_meshes(LoadTagLate, []() -> MeshBuffer const * {
+	MeshBuffer *ret = musicmurdermystery_mesh_data;
+	ret->upload();
 	musicmurdermystery_meshes_for_lit_color_texture_program = ret->make_vao_for_program(lit_color_texture_program->program);
+	musicmurdermystery_meshes_for_instanced_lit_color_texture_program = ret->make_vao_for_program(instanced_lit_color_texture_program->program);
 	return ret;
-});
+}, LoadOnMainThread, "musicmurdermystery.pnct (upload)");
+
+//(the scene's mesh instances, recorded while parsing and turned into drawables once the meshes are uploaded)
+Scene *musicmurdermystery_scene_data = nullptr;
+std::vector< std::pair< Scene::Transform *, std::string > > musicmurdermystery_scene_meshes;
+Load< void > read_musicmurdermystery_scene(LoadTagDefault, [](){
+	musicmurdermystery_scene_data = new Scene(data_path("musicmurdermystery.scene"), [&](Scene &scene, Scene::Transform *transform, std::string const &mesh_name){
+		musicmurdermystery_scene_meshes.emplace_back(transform, mesh_name);
+	});
+}, LoadOnAnyThread, "musicmurdermystery.scene");
 
-Load< Scene > musicmurdermystery_scene(LoadTagDefault, []() -> Scene const * {
-	return new Scene(data_path("musicmurdermystery.scene"), [&](Scene &scene, Scene::Transform *transform, std::string const &mesh_name){
+Load< Scene > musicmurdermystery_scene(LoadTagLate, []() -> Scene const * {
+	Scene &scene = *musicmurdermystery_scene_data;
+	for (auto const &[transform, mesh_name] : musicmurdermystery_scene_meshes) {
 		Mesh const &mesh = musicmurdermystery_meshes->lookup(mesh_name);
 
 		scene.drawables.emplace_back(transform);
@@ -30,16 +51,41 @@ Load< Scene > musicmurdermystery_scene(LoadTagDefault, []() -> Scene const * {
 		drawable.pipeline = lit_color_texture_program_pipeline;
 
 		drawable.pipeline.vao = musicmurdermystery_meshes_for_lit_color_texture_program;
+		drawable.pipeline.instancing.vao = musicmurdermystery_meshes_for_instanced_lit_color_texture_program;
 		drawable.pipeline.type = mesh.type;
 		drawable.pipeline.start = mesh.start;
 		drawable.pipeline.count = mesh.count;
+		drawable.pipeline.min = mesh.min;
+		drawable.pipeline.max = mesh.max;
+	}
+	musicmurdermystery_scene_meshes.clear();
+	return &scene;
+}, LoadOnMainThread, "musicmurdermystery.scene (drawables)");
+
+//background music is long, so it is streamed rather than decoded up front:
+Load< Sound::Stream > dusty_floor_stream(LoadTagDefault, []() -> Sound::Stream const * {
+	return new Sound::Stream(data_path("dusty-floor.opus"));
+}, LoadOnAnyThread, "dusty-floor.opus");
+
+//helper: make a function that loads a sample from the data directory:
+std::function< Sound::Sample const *() > sample_loader(std::string const &filename, Sound::Sample::Format format = Sound::Sample::Format::Float) {
+	return [filename,format]() -> Sound::Sample const * {
+		return new Sound::Sample(data_path(filename), format);
+	};
+}
 
-	});
-});
+//alibis and evidence recordings are loaded on worker threads while the meshes load:
+// (they're long and only speech, so they're kept compressed and decoded as they play; see Sound::Sample::Format::Opus)
+Load< Sound::Sample > red_alibi_sample(LoadTagDefault, sample_loader("red-alibi.opus", Sound::Sample::Format::Opus), LoadOnAnyThread, "red-alibi.opus");
+Load< Sound::Sample > green_alibi_sample(LoadTagDefault, sample_loader("green-alibi.opus", Sound::Sample::Format::Opus), LoadOnAnyThread, "green-alibi.opus");
+Load< Sound::Sample > blue_alibi_sample(LoadTagDefault, sample_loader("blue-alibi.opus", Sound::Sample::Format::Opus), LoadOnAnyThread, "blue-alibi.opus");
+Load< Sound::Sample > yellow_alibi_sample(LoadTagDefault, sample_loader("yellow-alibi.opus", Sound::Sample::Format::Opus), LoadOnAnyThread, "yellow-alibi.opus");
 
-Load< Sound::Sample > dusty_floor_sample(LoadTagDefault, []() -> Sound::Sample const * {
-	return new Sound::Sample(data_path("dusty-floor.opus"));
-});
+Load< Sound::Sample > evidence0_sample(LoadTagDefault, sample_loader("evidence0.opus", Sound::Sample::Format::Opus), LoadOnAnyThread, "evidence0.opus");
+Load< Sound::Sample > evidence1_sample(LoadTagDefault, sample_loader("evidence1.opus", Sound::Sample::Format::Opus), LoadOnAnyThread, "evidence1.opus");
+Load< Sound::Sample > evidence2_sample(LoadTagDefault, sample_loader("evidence2.opus", Sound::Sample::Format::Opus), LoadOnAnyThread, "evidence2.opus");
+Load< Sound::Sample > evidence3_sample(LoadTagDefault, sample_loader("evidence3.opus", Sound::Sample::Format::Opus), LoadOnAnyThread, "evidence3.opus");
+Load< Sound::Sample > evidence4_sample(LoadTagDefault, sample_loader("evidence4.opus", Sound::Sample::Format::Opus), LoadOnAnyThread, "evidence4.opus");
 
 PlayMode::PlayMode() : scene(*musicmurdermystery_scene) {
 	//get pointers to leg for convenience:
@@ -68,13 +114,17 @@ PlayMode::PlayMode() : scene(*musicmurdermystery_scene) {
 	if (scene.cameras.size() != 1) throw std::runtime_error("Expecting scene to have exactly one camera, but it has " + std::to_string(scene.cameras.size()));
 	camera = &scene.cameras.front();
 
+	//group any non-instanced drawables to skip redundant state changes:
+	// (n.b. every drawable above uses the instanced pipeline, which draw() always groups, so this currently sorts nothing)
+	scene.sort_drawables = true;
+
 	glm::mat4x3 frame = camera->transform->make_local_to_parent();
 	glm::vec3 right = frame[0];
 	glm::vec3 at = frame[3];
 	Sound::listener.set_position_right(at, right, 1.0f / 60.0f);
 
 	//set background music
-	background_music = Sound::loop(*dusty_floor_sample, 0.3f, 1.0f);
+	background_music = Sound::loop_stream(*dusty_floor_stream, 0.3f, 1.0f, Sound::Bus::Music);
 
 	for (size_t i=0;i<suspects.size();i++)
 		alibis.push_back(nullptr);
@@ -82,16 +132,16 @@ PlayMode::PlayMode() : scene(*musicmurdermystery_scene) {
 		recordings.push_back(nullptr);
 
 	//abilis and evidences
-	alibi_samples.push_back(Sound::Sample(data_path("red-alibi.opus")));
-	alibi_samples.push_back(Sound::Sample(data_path("green-alibi.opus")));
-	alibi_samples.push_back(Sound::Sample(data_path("blue-alibi.opus")));
-	alibi_samples.push_back(Sound::Sample(data_path("yellow-alibi.opus")));
-
-	recording_samples.push_back(Sound::Sample(data_path("evidence0.opus")));
-	recording_samples.push_back(Sound::Sample(data_path("evidence1.opus")));
-	recording_samples.push_back(Sound::Sample(data_path("evidence2.opus")));
-	recording_samples.push_back(Sound::Sample(data_path("evidence3.opus")));
-	recording_samples.push_back(Sound::Sample(data_path("evidence4.opus")));
+	alibi_samples.push_back(red_alibi_sample);
+	alibi_samples.push_back(green_alibi_sample);
+	alibi_samples.push_back(blue_alibi_sample);
+	alibi_samples.push_back(yellow_alibi_sample);
+
+	recording_samples.push_back(evidence0_sample);
+	recording_samples.push_back(evidence1_sample);
+	recording_samples.push_back(evidence2_sample);
+	recording_samples.push_back(evidence3_sample);
+	recording_samples.push_back(evidence4_sample);
 }
 
 PlayMode::~PlayMode() {
@@ -118,6 +168,9 @@ bool PlayMode::handle_event(SDL_Event const &evt, glm::uvec2 const &window_size)
 			return true;
 		} else if (evt.key.keysym.sym == SDLK_SPACE) {
 			attempt_arrest();
+		} else if (evt.key.keysym.sym == SDLK_F3) {
+			show_mix_stats = !show_mix_stats;
+			return true;
 		}
 	} else if (evt.type == SDL_KEYUP) {
 		if (evt.key.keysym.sym == SDLK_a) {
@@ -181,13 +234,22 @@ void PlayMode::update(float elapsed) {
 		player_head->rotation = glm::normalize(new_rotation);
 
 		for (size_t i=0;i<alibis.size();i++) {
-			if (alibis[i] != nullptr && alibis[i]->stopped)
+			if (alibis[i] != nullptr && alibis[i]->stopped())
 				alibis[i] = nullptr;
 		}
 		for (size_t i=0;i<recordings.size();i++) {
-			if (recordings[i] != nullptr && recordings[i]->stopped)
+			if (recordings[i] != nullptr && recordings[i]->stopped())
 				recordings[i] = nullptr;
 		}
+
+		//duck the music while anyone is talking:
+		bool talking = false;
+		for (auto const &alibi : alibis) talking = talking || alibi != nullptr;
+		for (auto const &recording : recordings) talking = talking || recording != nullptr;
+		if (talking != music_ducked) {
+			music_ducked = talking;
+			Sound::set_bus_volume(Sound::Bus::Music, music_ducked ? 0.4f : 1.0f, 0.25f);
+		}
 	}
 
 	//reset button press counters:
@@ -206,6 +268,11 @@ void PlayMode::draw(glm::uvec2 const &drawable_size) {
 	glUniform1i(lit_color_texture_program->LIGHT_TYPE_int, 1);
 	glUniform3fv(lit_color_texture_program->LIGHT_DIRECTION_vec3, 1, glm::value_ptr(glm::vec3(0.0f, 0.0f,-1.0f)));
 	glUniform3fv(lit_color_texture_program->LIGHT_ENERGY_vec3, 1, glm::value_ptr(glm::vec3(1.0f, 1.0f, 0.95f)));
+	//..and for its instanced variant (used for repeated meshes):
+	glUseProgram(instanced_lit_color_texture_program->program);
+	glUniform1i(instanced_lit_color_texture_program->LIGHT_TYPE_int, 1);
+	glUniform3fv(instanced_lit_color_texture_program->LIGHT_DIRECTION_vec3, 1, glm::value_ptr(glm::vec3(0.0f, 0.0f,-1.0f)));
+	glUniform3fv(instanced_lit_color_texture_program->LIGHT_ENERGY_vec3, 1, glm::value_ptr(glm::vec3(1.0f, 1.0f, 0.95f)));
 	glUseProgram(0);
 
 	glClearColor(0.5f, 0.5f, 0.5f, 1.0f);
@@ -246,6 +313,44 @@ void PlayMode::draw(glm::uvec2 const &drawable_size) {
 			glm::vec3(H, 0.0f, 0.0f), glm::vec3(0.0f, H, 0.0f),
 			glm::u8vec4(0x00, 0x00, 0x00, 0x00));
 		}
+
+		if (show_mix_stats) { //audio mixer instrumentation (and scene drawing stats) in the upper left:
+			Sound::MixStats stats = Sound::get_mix_stats();
+			auto percent = [](float f) { return std::to_string(int32_t(std::round(f * 100.0f))) + "%"; };
+			constexpr float S = 0.05f;
+			glm::u8vec4 color(0xff, 0xff, 0x00, 0x00);
+			float y = 1.0f - 1.5f * S;
+			auto text = [&](std::string const &str) {
+				lines.draw_text(str, glm::vec3(-aspect + 0.5f * S, y, 0.0f), glm::vec3(S, 0.0f, 0.0f), glm::vec3(0.0f, S, 0.0f), color);
+				y -= 1.2f * S;
+			};
+			text("mix time: " + percent(stats.last_budget_used) + " of budget (avg " + percent(stats.average_budget_used) + ", peak " + percent(stats.peak_budget_used) + ")");
+			text("voices: " + std::to_string(stats.active_voices) + " (" + std::to_string(stats.real_voices) + " mixed, peak " + std::to_string(stats.peak_voices) + ")"
+				+ " +" + std::to_string(stats.voices_added) + " -" + std::to_string(stats.voices_removed));
+			text("callbacks: " + std::to_string(stats.callbacks) + ", late: " + std::to_string(stats.late_callbacks));
+
+			//histogram of mix time, one bar per 10% of budget (height relative to the most common bucket):
+			uint32_t most = 1;
+			for (uint32_t b = 0; b < Sound::MixStats::HistogramBuckets; ++b) most = std::max(most, stats.histogram[b]);
+			float x0 = -aspect + 0.5f * S;
+			float y0 = y - 3.0f * S;
+			for (uint32_t b = 0; b < Sound::MixStats::HistogramBuckets; ++b) {
+				float x = x0 + (b + 0.5f) * S;
+				float h = 3.0f * S * float(stats.histogram[b]) / float(most);
+				glm::u8vec4 bar = (b + 1 == Sound::MixStats::HistogramBuckets ? glm::u8vec4(0xff, 0x00, 0x00, 0x00) : color);
+				lines.draw(glm::vec3(x, y0, 0.0f), glm::vec3(x, y0 + h, 0.0f), bar);
+			}
+			lines.draw(glm::vec3(x0, y0, 0.0f), glm::vec3(x0 + Sound::MixStats::HistogramBuckets * S, y0, 0.0f), color);
+
+			//OpenGL traffic from drawing the scene this frame:
+			// (every PlayMode drawable is instanced, so these count the instanced path, not sort_drawables's render queue)
+			y = y0 - 1.5f * S;
+			Scene::DrawStats const &draw = scene.draw_stats;
+			text("scene (instanced): " + std::to_string(draw.drawables) + " drawables (" + std::to_string(draw.culled) + " culled), " + std::to_string(draw.draw_calls) + " draw calls ("
+				+ std::to_string(draw.instances) + " instances in " + std::to_string(draw.instanced_draw_calls) + " instanced draws)");
+			text("GL calls: " + std::to_string(draw.gl_calls) + " (" + std::to_string(draw.program_binds) + " program, "
+				+ std::to_string(draw.vao_binds) + " vao, " + std::to_string(draw.texture_binds) + " texture binds)");
+		}
 	}
 	GL_ERRORS();
 }
@@ -300,7 +405,7 @@ void PlayMode::play_alibi(size_t i) {
 		return;
 
 	if (alibis[i] == nullptr) {
-		alibis[i] = Sound::play(alibi_samples[i]);
+		alibis[i] = Sound::play(*alibi_samples[i], 1.0f, 0.0f, Sound::Bus::Dialogue);
 	}
 }
 
@@ -309,6 +414,6 @@ void PlayMode::play_recording(size_t i) {
 		return;
 
 	if (recordings[i] == nullptr) {
-		recordings[i] = Sound::play(recording_samples[i]);
+		recordings[i] = Sound::play(*recording_samples[i], 1.0f, 0.0f, Sound::Bus::Dialogue);
 	}
 }
@@ -49,16 +49,16 @@ struct PlayMode : Mode {
 
 	//suspect data
 	std::vector<Scene::Transform *> suspects;
-	std::vector<Sound::Sample> alibi_samples;
-	std::vector<std::shared_ptr<Sound::PlayingSample>> alibis;
+	std::vector<Sound::Sample const *> alibi_samples;
+	std::vector<Sound::PlayingSample> alibis;
 	float suspect_radius = 0.5f;
 	float suspect_speak_radius = 1.3f;
 	size_t murderer_id = 2; //Blue (suspect 2) is the murderer
 
 	//evidence data
 	std::vector<Scene::Transform *> evidences;
-	std::vector<Sound::Sample> recording_samples;
-	std::vector<std::shared_ptr<Sound::PlayingSample>> recordings;
+	std::vector<Sound::Sample const *> recording_samples;
+	std::vector<Sound::PlayingSample> recordings;
 	float evidence_radius = 0.5f;
 	float recording_play_radius = 1.3f;
 
@@ -66,9 +66,13 @@ struct PlayMode : Mode {
 	std::vector<Scene::Transform *> walls;
 
 	//background music
-	std::shared_ptr<Sound::PlayingSample> background_music;
+	Sound::PlayingSample background_music;
+	bool music_ducked = false; //is the music bus turned down for dialogue?
 	
 	//camera data
 	Scene::Camera *camera = nullptr;
 
+	//show audio mixer instrumentation and scene drawing stats (toggled with F3):
+	bool show_mix_stats = false;
+
 };
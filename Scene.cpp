@@ -1,11 +1,15 @@
 #include "Scene.hpp"
 
 #include "gl_errors.hpp"
+#include "MappedFile.hpp"
 #include "read_write_chunk.hpp"
 
 #include <glm/gtc/type_ptr.hpp>
 
+#include <algorithm>
+#include <cmath>
 #include <fstream>
+#include <limits>
 
 //-------------------------
 
@@ -73,6 +77,97 @@ glm::mat4x3 Scene::Transform::make_world_to_local() const {
 
 //-------------------------
 
+void Scene::update_world_matrices() const {
+	TransformCache &cache = transform_cache;
+
+	//check that the cache still matches the hierarchy:
+	bool valid = (cache.transforms.size() == transforms.size());
+	if (valid) {
+		for (auto const &t : transforms) {
+			if (t.cache_index >= cache.transforms.size() || cache.transforms[t.cache_index] != &t) {
+				valid = false;
+				break;
+			}
+			uint32_t parent = cache.parents[t.cache_index];
+			if (t.parent != (parent == -1U ? nullptr : cache.transforms[parent])) {
+				valid = false;
+				break;
+			}
+		}
+	}
+
+	if (!valid) {
+		//(re-)build the cache, ordering transforms so that parents come before their children:
+		cache.transforms.clear();
+		cache.transforms.reserve(transforms.size());
+		for (auto const &t : transforms) {
+			t.cache_index = -1U;
+		}
+		std::vector< Transform const * > chain;
+		for (auto const &t : transforms) {
+			//add any not-yet-added ancestors (root first), then t itself:
+			chain.clear();
+			for (Transform const *a = &t; a && a->cache_index == -1U; a = a->parent) {
+				chain.emplace_back(a);
+			}
+			for (auto a = chain.rbegin(); a != chain.rend(); ++a) {
+				(*a)->cache_index = uint32_t(cache.transforms.size());
+				cache.transforms.emplace_back(*a);
+			}
+		}
+		if (cache.transforms.size() != transforms.size()) {
+			throw std::runtime_error("Scene contains transforms whose parents aren't in the scene.");
+		}
+
+		size_t count = cache.transforms.size();
+		cache.parents.resize(count);
+		for (size_t i = 0; i < count; ++i) {
+			Transform const *parent = cache.transforms[i]->parent;
+			cache.parents[i] = (parent ? parent->cache_index : -1U);
+			if (parent && !(cache.parents[i] < count && cache.transforms[cache.parents[i]] == parent)) {
+				throw std::runtime_error("Scene contains transforms whose parents aren't in the scene.");
+			}
+		}
+		//NaN positions will never compare equal, so every matrix gets computed on the pass below:
+		cache.positions.assign(count, glm::vec3(std::numeric_limits< float >::quiet_NaN()));
+		cache.rotations.assign(count, glm::quat());
+		cache.scales.assign(count, glm::vec3(1.0f));
+		cache.dirty.assign(count, 1);
+		cache.local_to_world.assign(count, glm::mat4x3(1.0f));
+	}
+
+	//compute world matrices in one pass; parents always come first, so their matrices are already up to date:
+	for (size_t i = 0; i < cache.transforms.size(); ++i) {
+		Transform const &t = *cache.transforms[i];
+		bool changed = (t.position != cache.positions[i] || t.rotation != cache.rotations[i] || t.scale != cache.scales[i]);
+		if (changed) {
+			cache.positions[i] = t.position;
+			cache.rotations[i] = t.rotation;
+			cache.scales[i] = t.scale;
+		}
+		uint32_t parent = cache.parents[i];
+		cache.dirty[i] = changed || (parent != -1U && cache.dirty[parent]);
+		if (cache.dirty[i]) {
+			if (parent == -1U) {
+				cache.local_to_world[i] = t.make_local_to_parent();
+			} else {
+				cache.local_to_world[i] = cache.local_to_world[parent] * glm::mat4(t.make_local_to_parent()); //note: glm::mat4(glm::mat4x3) pads with a (0,0,0,1) row
+			}
+		}
+	}
+}
+
+glm::mat4x3 Scene::world_matrix(Transform const &transform) const {
+	TransformCache const &cache = transform_cache;
+	if (transform.cache_index < cache.transforms.size() && cache.transforms[transform.cache_index] == &transform) {
+		return cache.local_to_world[transform.cache_index];
+	} else {
+		return transform.make_local_to_world();
+	}
+}
+
+//-------------------------
+
 glm::mat4 Scene::Camera::make_projection() const {
 	return glm::infinitePerspective( fovy, aspect, near );
 }
@@ -87,9 +182,38 @@ void Scene::draw(Camera const &camera) const {
 	draw(world_to_clip, world_to_light);
 }
 
+//buffer (and buffer texture) used to send per-instance data to instanced programs:
+namespace {
+	GLuint instance_buffer = 0;
+	GLuint instance_buffer_texture = 0;
+}
+
 void Scene::draw(glm::mat4 const &world_to_clip, glm::mat4x3 const &world_to_light) const {
+	draw_stats = DrawStats();
+
+	//compute all world matrices at once:
+	update_world_matrices();
+
+	//Gather the drawables that will actually draw something:
+	draw_queue.clear();
+	instance_queue.clear();
+
+	//helper: queue a drawable to be drawn:
+	auto enqueue = [&](Drawable const *drawable) {
+		Scene::Drawable::Pipeline const &pipeline = drawable->pipeline;
+		//drawables with an instanced pipeline (and no per-drawable uniforms) are drawn in groups:
+		if (pipeline.instancing.program != 0 && pipeline.instancing.vao != 0 && !pipeline.set_uniforms) {
+			instance_queue.emplace_back(QueuedDrawable{drawable, uint32_t(instance_queue.size())});
+		} else {
+			draw_queue.emplace_back(drawable);
+		}
+	};
+
+	CullData &cull = cull_data;
+	cull.drawables.clear();
+	cull.cx.clear(); cull.cy.clear(); cull.cz.clear();
+	cull.ex.clear(); cull.ey.clear(); cull.ez.clear();
 
-	//Iterate through all drawables, sending each one to OpenGL:
 	for (auto const &drawable : drawables) {
 		//Reference to drawable's pipeline for convenience:
 		Scene::Drawable::Pipeline const &pipeline = drawable.pipeline;
@@ -101,23 +225,200 @@ void Scene::draw(glm::mat4 const &world_to_clip, glm::mat4x3 const &world_to_lig
 		//skip any drawables that don't contain any vertices:
 		if (pipeline.count == 0) continue;
 
+		draw_stats.drawables += 1;
+
+		if (!cull_drawables) {
+			enqueue(&drawable);
+			continue;
+		}
+
+		cull.drawables.emplace_back(&drawable);
+
+		//drawables without bounds can't be culled, so give them a box that is never outside:
+		if (!(pipeline.min.x <= pipeline.max.x && pipeline.min.y <= pipeline.max.y && pipeline.min.z <= pipeline.max.z)) {
+			constexpr float Big = std::numeric_limits< float >::max();
+			cull.cx.emplace_back(0.0f); cull.cy.emplace_back(0.0f); cull.cz.emplace_back(0.0f);
+			cull.ex.emplace_back(Big); cull.ey.emplace_back(Big); cull.ez.emplace_back(Big);
+			continue;
+		}
+
+		//world-space bounding box of the object-space bounding box:
+		assert(drawable.transform); //drawables *must* have a transform
+		glm::mat4x3 object_to_world = world_matrix(*drawable.transform);
+		glm::vec3 center = object_to_world * glm::vec4(0.5f * (pipeline.min + pipeline.max), 1.0f);
+		glm::vec3 half = 0.5f * (pipeline.max - pipeline.min);
+		glm::vec3 extent =
+			  glm::abs(object_to_world[0]) * half.x
+			+ glm::abs(object_to_world[1]) * half.y
+			+ glm::abs(object_to_world[2]) * half.z;
+
+		cull.cx.emplace_back(center.x); cull.cy.emplace_back(center.y); cull.cz.emplace_back(center.z);
+		cull.ex.emplace_back(extent.x); cull.ey.emplace_back(extent.y); cull.ez.emplace_back(extent.z);
+	}
+
+	if (!cull.drawables.empty()) {
+		//frustum planes (in world space) from the rows of world_to_clip:
+		// a point is inside when dot(plane.xyz, p) + plane.w >= 0 for every plane
+		glm::vec4 rows[4];
+		for (uint32_t r = 0; r < 4; ++r) {
+			rows[r] = glm::vec4(world_to_clip[0][r], world_to_clip[1][r], world_to_clip[2][r], world_to_clip[3][r]);
+		}
+		glm::vec4 planes[6] = {
+			rows[3] + rows[0], rows[3] - rows[0], //left, right
+			rows[3] + rows[1], rows[3] - rows[1], //bottom, top
+			rows[3] + rows[2], rows[3] - rows[2], //near, far
+		};
+
+		size_t count = cull.drawables.size();
+		cull.visible.assign(count, 1);
+		float const *cx = cull.cx.data(), *cy = cull.cy.data(), *cz = cull.cz.data();
+		float const *ex = cull.ex.data(), *ey = cull.ey.data(), *ez = cull.ez.data();
+		uint8_t *visible = cull.visible.data();
+		for (glm::vec4 const &plane : planes) {
+			//skip degenerate planes (e.g., the far plane of an infinite projection):
+			if (plane.x == 0.0f && plane.y == 0.0f && plane.z == 0.0f) continue;
+			float nx = plane.x, ny = plane.y, nz = plane.z, w = plane.w;
+			float ax = std::abs(nx), ay = std::abs(ny), az = std::abs(nz);
+			//box is outside if even its most-inside corner is behind the plane:
+			// (straight-line loop over arrays so the compiler can vectorize it)
+			for (size_t i = 0; i < count; ++i) {
+				float d = nx * cx[i] + ny * cy[i] + nz * cz[i] + w + ax * ex[i] + ay * ey[i] + az * ez[i];
+				visible[i] &= uint8_t(d >= 0.0f);
+			}
+		}
+
+		//queue visible drawables (in their original order):
+		for (size_t i = 0; i < count; ++i) {
+			if (visible[i]) enqueue(cull.drawables[i]);
+			else draw_stats.culled += 1;
+		}
+	}
+
+	//helper: order drawables by the texture objects (and targets) they use:
+	auto compare_textures = [](Drawable::Pipeline const &pa, Drawable::Pipeline const &pb) {
+		for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount; ++i) {
+			if (pa.textures[i].texture != pb.textures[i].texture) return pa.textures[i].texture < pb.textures[i].texture;
+			if (pa.textures[i].target != pb.textures[i].target) return pa.textures[i].target < pb.textures[i].target;
+		}
+		return false;
+	};
+
+	//In render-queue mode, group drawables that share state so fewer state changes are needed:
+	// (stable, so drawables with the same state still draw in the order they were added)
+	if (sort_drawables) {
+		std::stable_sort(draw_queue.begin(), draw_queue.end(), [&](Drawable const *a, Drawable const *b) {
+			Drawable::Pipeline const &pa = a->pipeline;
+			Drawable::Pipeline const &pb = b->pipeline;
+			if (pa.program != pb.program) return pa.program < pb.program;
+			if (pa.vao != pb.vao) return pa.vao < pb.vao;
+			return compare_textures(pa, pb);
+		});
+	}
+
+	//helper: can two drawables be drawn by the same instanced draw call?
+	auto same_instance_group = [](QueuedDrawable const &a, QueuedDrawable const &b) {
+		Drawable::Pipeline const &pa = a.drawable->pipeline;
+		Drawable::Pipeline const &pb = b.drawable->pipeline;
+		if (pa.instancing.program != pb.instancing.program || pa.instancing.vao != pb.instancing.vao) return false;
+		if (pa.type != pb.type || pa.start != pb.start || pa.count != pb.count) return false;
+		for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount; ++i) {
+			if (pa.textures[i].texture != pb.textures[i].texture || pa.textures[i].target != pb.textures[i].target) return false;
+		}
+		return true;
+	};
+
+	//Instanced drawables are always grouped, by the same fields same_instance_group compares:
+	// (ties are broken by queue order, which keeps the result stable without std::stable_sort's per-call buffer)
+	std::sort(instance_queue.begin(), instance_queue.end(), [&](QueuedDrawable const &a, QueuedDrawable const &b) {
+		Drawable::Pipeline const &pa = a.drawable->pipeline;
+		Drawable::Pipeline const &pb = b.drawable->pipeline;
+		if (pa.instancing.program != pb.instancing.program) return pa.instancing.program < pb.instancing.program;
+		if (pa.instancing.vao != pb.instancing.vao) return pa.instancing.vao < pb.instancing.vao;
+		if (pa.start != pb.start) return pa.start < pb.start;
+		if (pa.count != pb.count) return pa.count < pb.count;
+		if (pa.type != pb.type) return pa.type < pb.type;
+		if (compare_textures(pa, pb)) return true;
+		if (compare_textures(pb, pa)) return false;
+		return a.order < b.order;
+	});
+
+	//OpenGL state as set by this function (used to skip redundant state changes):
+	GLuint current_program = 0;
+	GLuint current_vao = 0;
+	Drawable::Pipeline::TextureInfo current_textures[Drawable::Pipeline::TextureCount];
+	uint32_t current_unit = 0; //(GL_TEXTURE0 is the default active texture)
+
+	//helper: set the shader program:
+	auto use_program = [&](GLuint program) {
+		if (program == current_program) return;
+		glUseProgram(program);
+		current_program = program;
+		draw_stats.gl_calls += 1;
+		draw_stats.program_binds += 1;
+	};
+
+	//helper: set attribute sources:
+	auto use_vao = [&](GLuint vao) {
+		if (vao == current_vao) return;
+		glBindVertexArray(vao);
+		current_vao = vao;
+		draw_stats.gl_calls += 1;
+		draw_stats.vao_binds += 1;
+	};
+
+	//helper: bind a texture to a texture unit:
+	auto bind_texture = [&](uint32_t i, GLenum target, GLuint texture) {
+		if (current_unit != i) {
+			glActiveTexture(GL_TEXTURE0 + i);
+			draw_stats.gl_calls += 1;
+			current_unit = i;
+		}
+		glBindTexture(target, texture);
+		draw_stats.gl_calls += 1;
+		draw_stats.texture_binds += 1;
+	};
+
+	//helper: set up textures (units a pipeline doesn't use are left empty, as if freshly un-bound):
+	auto use_textures = [&](Drawable::Pipeline const &pipeline) {
+		for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount; ++i) {
+			Drawable::Pipeline::TextureInfo const &want = pipeline.textures[i];
+			Drawable::Pipeline::TextureInfo &have = current_textures[i];
+			if (want.texture != 0) {
+				if (want.texture != have.texture || want.target != have.target) {
+					if (have.texture != 0 && have.target != want.target) bind_texture(i, have.target, 0);
+					bind_texture(i, want.target, want.texture);
+					have = want;
+				}
+			} else if (have.texture != 0) {
+				bind_texture(i, have.target, 0);
+				have.texture = 0;
+			}
+		}
+	};
+
+	//Iterate through all non-instanced drawables, sending each one to OpenGL:
+	for (Drawable const *drawable_ptr : draw_queue) {
+		Drawable const &drawable = *drawable_ptr;
+		//Reference to drawable's pipeline for convenience:
+		Scene::Drawable::Pipeline const &pipeline = drawable.pipeline;
 
 		//Set shader program:
-		glUseProgram(pipeline.program);
+		use_program(pipeline.program);
 
 		//Set attribute sources:
-		glBindVertexArray(pipeline.vao);
+		use_vao(pipeline.vao);
 
 		//Configure program uniforms:
 
 		//the object-to-world matrix is used in all three of these uniforms:
 		assert(drawable.transform); //drawables *must* have a transform
-		glm::mat4x3 object_to_world = drawable.transform->make_local_to_world();
+		glm::mat4x3 object_to_world = world_matrix(*drawable.transform);
 
 		//OBJECT_TO_CLIP takes vertices from object space to clip space:
 		if (pipeline.OBJECT_TO_CLIP_mat4 != -1U) {
 			glm::mat4 object_to_clip = world_to_clip * glm::mat4(object_to_world);
 			glUniformMatrix4fv(pipeline.OBJECT_TO_CLIP_mat4, 1, GL_FALSE, glm::value_ptr(object_to_clip));
+			draw_stats.gl_calls += 1;
 		}
 
 		//the object-to-light matrix is used in the next two uniforms:
@@ -126,41 +427,116 @@ void Scene::draw(glm::mat4 const &world_to_clip, glm::mat4x3 const &world_to_lig
 		//OBJECT_TO_CLIP takes vertices from object space to light space:
 		if (pipeline.OBJECT_TO_LIGHT_mat4x3 != -1U) {
 			glUniformMatrix4x3fv(pipeline.OBJECT_TO_LIGHT_mat4x3, 1, GL_FALSE, glm::value_ptr(object_to_light));
+			draw_stats.gl_calls += 1;
 		}
 
 		//NORMAL_TO_CLIP takes normals from object space to light space:
 		if (pipeline.NORMAL_TO_LIGHT_mat3 != -1U) {
 			glm::mat3 normal_to_light = glm::inverse(glm::transpose(glm::mat3(object_to_light)));
 			glUniformMatrix3fv(pipeline.NORMAL_TO_LIGHT_mat3, 1, GL_FALSE, glm::value_ptr(normal_to_light));
+			draw_stats.gl_calls += 1;
 		}
 
 		//set any requested custom uniforms:
 		if (pipeline.set_uniforms) pipeline.set_uniforms();
 
 		//set up textures:
-		for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount; ++i) {
-			if (pipeline.textures[i].texture != 0) {
-				glActiveTexture(GL_TEXTURE0 + i);
-				glBindTexture(pipeline.textures[i].target, pipeline.textures[i].texture);
-			}
-		}
+		use_textures(pipeline);
 
 		//draw the object:
 		glDrawArrays(pipeline.type, pipeline.start, pipeline.count);
+		draw_stats.gl_calls += 1;
+		draw_stats.draw_calls += 1;
+	}
 
-		//un-bind textures:
-		for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount; ++i) {
-			if (pipeline.textures[i].texture != 0) {
-				glActiveTexture(GL_TEXTURE0 + i);
-				glBindTexture(pipeline.textures[i].target, 0);
+	//Draw instanced drawables, one draw call per group:
+	if (!instance_queue.empty()) {
+		//per-instance data is uploaded to one buffer for all groups:
+		instance_data.clear();
+		instance_data.reserve(instance_queue.size() * 6);
+		for (QueuedDrawable const &queued : instance_queue) {
+			Drawable const *drawable_ptr = queued.drawable;
+			assert(drawable_ptr->transform); //drawables *must* have a transform
+			glm::mat4x3 object_to_world = world_matrix(*drawable_ptr->transform);
+			glm::mat3 normal_to_light = glm::inverse(glm::transpose(glm::mat3(world_to_light * glm::mat4(object_to_world))));
+			for (uint32_t r = 0; r < 3; ++r) {
+				instance_data.emplace_back(object_to_world[0][r], object_to_world[1][r], object_to_world[2][r], object_to_world[3][r]);
+			}
+			for (uint32_t r = 0; r < 3; ++r) {
+				instance_data.emplace_back(normal_to_light[0][r], normal_to_light[1][r], normal_to_light[2][r], 0.0f);
 			}
 		}
-		glActiveTexture(GL_TEXTURE0);
 
+		if (instance_buffer == 0) {
+			glGenBuffers(1, &instance_buffer);
+			glGenTextures(1, &instance_buffer_texture);
+			glBindTexture(GL_TEXTURE_BUFFER, instance_buffer_texture);
+			glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, instance_buffer);
+			glBindTexture(GL_TEXTURE_BUFFER, 0);
+			draw_stats.gl_calls += 5;
+		}
+		glBindBuffer(GL_TEXTURE_BUFFER, instance_buffer);
+		glBufferData(GL_TEXTURE_BUFFER, instance_data.size() * sizeof(glm::vec4), instance_data.data(), GL_STREAM_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		draw_stats.gl_calls += 3;
+
+		bind_texture(Drawable::Pipeline::TextureCount, GL_TEXTURE_BUFFER, instance_buffer_texture);
+
+		GLuint uniforms_program = 0; //program whose camera uniforms have been set
+		for (size_t begin = 0; begin < instance_queue.size(); /* later */) {
+			size_t end = begin + 1;
+			while (end < instance_queue.size() && same_instance_group(instance_queue[begin], instance_queue[end])) ++end;
+
+			Drawable::Pipeline const &pipeline = instance_queue[begin].drawable->pipeline;
+
+			use_program(pipeline.instancing.program);
+			use_vao(pipeline.instancing.vao);
+
+			//camera uniforms are the same for every group, so only set them once per program:
+			if (uniforms_program != pipeline.instancing.program) {
+				uniforms_program = pipeline.instancing.program;
+				if (pipeline.instancing.WORLD_TO_CLIP_mat4 != -1U) {
+					glUniformMatrix4fv(pipeline.instancing.WORLD_TO_CLIP_mat4, 1, GL_FALSE, glm::value_ptr(world_to_clip));
+					draw_stats.gl_calls += 1;
+				}
+				if (pipeline.instancing.WORLD_TO_LIGHT_mat4x3 != -1U) {
+					glUniformMatrix4x3fv(pipeline.instancing.WORLD_TO_LIGHT_mat4x3, 1, GL_FALSE, glm::value_ptr(world_to_light));
+					draw_stats.gl_calls += 1;
+				}
+			}
+			if (pipeline.instancing.INSTANCE_BASE_int != -1U) {
+				glUniform1i(pipeline.instancing.INSTANCE_BASE_int, GLint(begin));
+				draw_stats.gl_calls += 1;
+			}
+
+			use_textures(pipeline);
+
+			glDrawArraysInstanced(pipeline.type, pipeline.start, pipeline.count, GLsizei(end - begin));
+			draw_stats.gl_calls += 1;
+			draw_stats.draw_calls += 1;
+			draw_stats.instanced_draw_calls += 1;
+			draw_stats.instances += uint32_t(end - begin);
+
+			begin = end;
+		}
+
+		bind_texture(Drawable::Pipeline::TextureCount, GL_TEXTURE_BUFFER, 0);
+	}
+
+	//un-bind textures:
+	for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount; ++i) {
+		if (current_textures[i].texture != 0) {
+			bind_texture(i, current_textures[i].target, 0);
+		}
+	}
+	if (current_unit != 0) {
+		glActiveTexture(GL_TEXTURE0);
+		draw_stats.gl_calls += 1;
 	}
 
 	glUseProgram(0);
 	glBindVertexArray(0);
+	draw_stats.gl_calls += 2;
 
 	GL_ERRORS();
 }
@@ -169,10 +545,12 @@ void Scene::draw(glm::mat4 const &world_to_clip, glm::mat4x3 const &world_to_lig
 void Scene::load(std::string const &filename,
 	std::function< void(Scene &, Transform *, std::string const &) > const &on_drawable) {
 
-	std::ifstream file(filename, std::ios::binary);
+	//main chunks are parsed directly out of the mapped file (no intermediate copies):
+	MappedFile mapped(filename);
+	ChunkReader reader(mapped.data, mapped.size);
 
-	std::vector< char > names;
-	read_chunk(file, "str0", &names);
+	ChunkSpan< char > names;
+	read_chunk(reader, "str0", &names);
 
 	struct HierarchyEntry {
 		uint32_t parent;
@@ -183,8 +561,8 @@ void Scene::load(std::string const &filename,
 		glm::vec3 scale;
 	};
 	static_assert(sizeof(HierarchyEntry) == 4 + 4 + 4 + 4*3 + 4*4 + 4*3, "HierarchyEntry is packed.");
-	std::vector< HierarchyEntry > hierarchy;
-	read_chunk(file, "xfh0", &hierarchy);
+	ChunkSpan< HierarchyEntry > hierarchy;
+	read_chunk(reader, "xfh0", &hierarchy);
 
 	struct MeshEntry {
 		uint32_t transform;
@@ -192,8 +570,8 @@ void Scene::load(std::string const &filename,
 		uint32_t name_end;
 	};
 	static_assert(sizeof(MeshEntry) == 4 + 4 + 4, "MeshEntry is packed.");
-	std::vector< MeshEntry > meshes;
-	read_chunk(file, "msh0", &meshes);
+	ChunkSpan< MeshEntry > meshes;
+	read_chunk(reader, "msh0", &meshes);
 
 	struct CameraEntry {
 		uint32_t transform;
@@ -202,8 +580,8 @@ void Scene::load(std::string const &filename,
 		float clip_near, clip_far;
 	};
 	static_assert(sizeof(CameraEntry) == 4 + 4 + 4 + 4 + 4, "CameraEntry is packed.");
-	std::vector< CameraEntry > cameras;
-	read_chunk(file, "cam0", &cameras);
+	ChunkSpan< CameraEntry > cameras;
+	read_chunk(reader, "cam0", &cameras);
 
 	struct LightEntry {
 		uint32_t transform;
@@ -214,8 +592,8 @@ void Scene::load(std::string const &filename,
 		float fov;
 	};
 	static_assert(sizeof(LightEntry) == 4 + 1 + 3 + 4 + 4 + 4, "LightEntry is packed.");
-	std::vector< LightEntry > lights;
-	read_chunk(file, "lmp0", &lights);
+	ChunkSpan< LightEntry > lights;
+	read_chunk(reader, "lmp0", &lights);
 
 
 	//--------------------------------
@@ -302,7 +680,10 @@ void Scene::load(std::string const &filename,
 	}
 
 	//load any extra that a subclass wants:
-	load_extra(file, names, hierarchy_transforms);
+	// (load_extra reads from a stream, so open one positioned just after the main chunks)
+	std::ifstream file(filename, std::ios::binary);
+	file.seekg(reader.offset);
+	load_extra(file, std::vector< char >(names.begin(), names.end()), hierarchy_transforms);
 
 	if (file.peek() != EOF) {
 		std::cerr << "WARNING: trailing data in scene file '" << filename << "'" << std::endl;
@@ -334,6 +715,12 @@ void Scene::set(Scene const &other, std::unordered_map< Transform const *, Trans
 
 	transform_to_transform.clear();
 
+	//cached world matrices refer to the old transforms:
+	transform_cache = TransformCache();
+
+	sort_drawables = other.sort_drawables;
+	cull_drawables = other.cull_drawables;
+
 	//null transform maps to itself:
 	transform_to_transform.insert(std::make_pair(nullptr, nullptr));
 
@@ -15,6 +15,7 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
 
+#include <limits>
 #include <list>
 #include <memory>
 #include <functional>
@@ -43,6 +44,9 @@ struct Scene {
 		glm::mat4x3 make_local_to_world() const;
 		glm::mat4x3 make_world_to_local() const;
 
+		//position of this transform in its scene's TransformCache (if any; see Scene::update_world_matrices):
+		mutable uint32_t cache_index = -1U;
+
 		//since hierarchy is tracked through pointers, copy-constructing a transform  is not advised:
 		Transform(Transform const &) = delete;
 		//if we delete some constructors, we need to let the compiler know that the default constructor is still okay:
@@ -65,6 +69,11 @@ struct Scene {
 			GLuint start = 0; //first vertex to draw; passed to glDrawArrays
 			GLuint count = 0; //number of vertices to draw; passed to glDrawArrays
 
+			//bounding box of the vertices (in object space), used to skip drawables outside the view:
+			// (if min > max -- as by default -- the drawable is never culled)
+			glm::vec3 min = glm::vec3( std::numeric_limits< float >::infinity());
+			glm::vec3 max = glm::vec3(-std::numeric_limits< float >::infinity());
+
 			//uniforms:
 			GLuint OBJECT_TO_CLIP_mat4 = -1U; //uniform location for object to clip space matrix
 			GLuint OBJECT_TO_LIGHT_mat4x3 = -1U; //uniform location for object to light space (== world space) matrix
@@ -78,6 +87,20 @@ struct Scene {
 				GLuint texture = 0;
 				GLenum target = GL_TEXTURE_2D;
 			} textures[TextureCount];
+
+			//(optional) instanced version of this pipeline:
+			// if set (and set_uniforms is not), drawables with the same mesh, textures, and instanced program
+			// are drawn together with one glDrawArraysInstanced call (possibly out of order with other drawables).
+			// the instanced program reads per-instance matrices from a buffer texture bound to unit TextureCount:
+			//   texel (INSTANCE_BASE + gl_InstanceID) * 6 + [0,3) -- rows of the object-to-world matrix
+			//   texel (INSTANCE_BASE + gl_InstanceID) * 6 + [3,6) -- rows of the normal-to-light matrix (w unused)
+			struct Instancing {
+				GLuint program = 0; //instanced shader program
+				GLuint vao = 0; //attrib->buffer mapping for the instanced program (same vertices as 'vao')
+				GLuint WORLD_TO_CLIP_mat4 = -1U; //uniform location for world to clip space matrix
+				GLuint WORLD_TO_LIGHT_mat4x3 = -1U; //uniform location for world to light space matrix
+				GLuint INSTANCE_BASE_int = -1U; //uniform location for index of first instance in the buffer texture
+			} instancing;
 		} pipeline;
 	};
 
@@ -122,12 +145,73 @@ struct Scene {
 	std::list< Camera > cameras;
 	std::list< Light > lights;
 
+	//Local-to-world matrices for every transform, computed together in one linear pass:
+	// (stored structure-of-arrays, with each transform's parent before it)
+	struct TransformCache {
+		std::vector< Transform const * > transforms; //transforms, in parent-before-child order
+		std::vector< uint32_t > parents; //index of each transform's parent (-1U for none)
+		std::vector< glm::vec3 > positions; //local transform as of the last update (used to notice changes)
+		std::vector< glm::quat > rotations;
+		std::vector< glm::vec3 > scales;
+		std::vector< uint8_t > dirty; //did the world matrix change in the last update?
+		std::vector< glm::mat4x3 > local_to_world; //cached world matrices
+	};
+	mutable TransformCache transform_cache;
+
+	//Bring transform_cache up to date with 'transforms':
+	// (rebuilds the cache if transforms were added, removed, or re-parented;
+	//  otherwise only recomputes matrices for transforms that moved, or whose ancestors moved)
+	// called by draw(); call it yourself if you want to use world_matrix() elsewhere.
+	void update_world_matrices() const;
+
+	//Cached local-to-world matrix of a transform in this scene (as of the last update_world_matrices()):
+	// (falls back to transform.make_local_to_world() if the transform isn't in the cache)
+	glm::mat4x3 world_matrix(Transform const &transform) const;
+
 	//The "draw" function provides a convenient way to pass all the things in a scene to OpenGL:
 	void draw(Camera const &camera) const;
 
 	//..sometimes, you want to draw with a custom projection matrix and/or light space:
 	void draw(glm::mat4 const &world_to_clip, glm::mat4x3 const &world_to_light = glm::mat4x3(1.0f)) const;
 
+	//"render-queue" mode: draw() sorts drawables by program, vertex array, and textures
+	// so that consecutive drawables share state. (Don't use with drawables that depend on draw order, e.g., for blending.)
+	// either way, draw() only changes OpenGL state when it differs from the previous drawable's.
+	bool sort_drawables = false;
+
+	//frustum culling: draw() skips drawables whose (world-space) bounding boxes are outside the view:
+	bool cull_drawables = true;
+
+	//What the most recent draw() call sent to OpenGL:
+	struct DrawStats {
+		uint32_t drawables = 0; //drawables submitted
+		uint32_t culled = 0; //..of which were outside the view (and so not drawn)
+		uint32_t draw_calls = 0; //glDraw* calls
+		uint32_t instanced_draw_calls = 0; //..of which were glDrawArraysInstanced calls
+		uint32_t instances = 0; //drawables drawn by instanced draw calls
+		uint32_t program_binds = 0; //glUseProgram calls (not counting the final un-bind)
+		uint32_t vao_binds = 0; //glBindVertexArray calls (not counting the final un-bind)
+		uint32_t texture_binds = 0; //glBindTexture calls
+		uint32_t gl_calls = 0; //total OpenGL calls made by draw() itself (not counting set_uniforms callbacks)
+	};
+	mutable DrawStats draw_stats;
+
+	//(internal) reused between frames to avoid allocation:
+	mutable std::vector< Drawable const * > draw_queue;
+	struct QueuedDrawable {
+		Drawable const *drawable;
+		uint32_t order; //position in the queue before sorting (for tie-breaks)
+	};
+	mutable std::vector< QueuedDrawable > instance_queue;
+	mutable std::vector< glm::vec4 > instance_data;
+	struct CullData { //world-space boxes of drawables being culled, structure-of-arrays for batch testing:
+		std::vector< Drawable const * > drawables;
+		std::vector< float > cx, cy, cz; //box centers
+		std::vector< float > ex, ey, ez; //box half-extents
+		std::vector< uint8_t > visible;
+	};
+	mutable CullData cull_data;
+
 	//add transforms/objects/cameras from a scene file to this scene:
 	// the 'on_drawable' callback gives your code a chance to look up mesh data and make Drawables:
 	// throws on file format errors
@@ -136,4 +136,30 @@ void ShowSceneMode::draw(glm::uvec2 const &drawable_size) {
 		*/
 	}
 
+	{ //report culling and draw stats in the corner:
+		float aspect = float(drawable_size.x) / float(drawable_size.y);
+		DrawLines draw_lines(glm::mat4(
+			1.0f / aspect, 0.0f, 0.0f, 0.0f,
+			0.0f, 1.0f, 0.0f, 0.0f,
+			0.0f, 0.0f, 1.0f, 0.0f,
+			0.0f, 0.0f, 0.0f, 1.0f
+		));
+		constexpr float H = 0.06f;
+		Scene::DrawStats const &stats = scene.draw_stats;
+		draw_lines.draw_text(
+			std::to_string(stats.drawables - stats.culled) + " drawn, " + std::to_string(stats.culled) + " culled of " + std::to_string(stats.drawables) + " drawables",
+			glm::vec3(-aspect + 0.1f * H, -1.0f + 0.1f * H, 0.0f),
+			glm::vec3(H, 0.0f, 0.0f), glm::vec3(0.0f, H, 0.0f),
+			glm::u8vec4(0xff, 0xff, 0xff, 0xff)
+		);
+		draw_lines.draw_text(
+			std::to_string(stats.draw_calls) + " draw calls, " + std::to_string(stats.gl_calls) + " GL calls (" + std::to_string(stats.program_binds) + " program, "
+				+ std::to_string(stats.vao_binds) + " vao, " + std::to_string(stats.texture_binds) + " texture binds)"
+				+ (scene.sort_drawables ? ", sorted" : ""),
+			glm::vec3(-aspect + 0.1f * H, -1.0f + 1.3f * H, 0.0f),
+			glm::vec3(H, 0.0f, 0.0f), glm::vec3(0.0f, H, 0.0f),
+			glm::u8vec4(0xff, 0xff, 0xff, 0xff)
+		);
+	}
+
 }
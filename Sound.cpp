@@ -1,27 +1,267 @@
 #include "Sound.hpp"
 #include "load_wav.hpp"
 #include "load_opus.hpp"
+#include "pcm_cache.hpp"
+#include "sample_codec.hpp"
+#include "mix_kernels.hpp"
+#include "MappedFile.hpp"
 
 #include <SDL.h>
 
-#include <list>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cmath>
 #include <exception>
 #include <iostream>
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 
 //local (to this file) data used by the audio system:
 namespace {
 
 	//handy constants:
 	constexpr uint32_t const AUDIO_RATE = 48000; //sampling rate
-	constexpr uint32_t const MIX_SAMPLES = 1024; //number of samples to mix per call of mix_audio callback; n.b. SDL requires this to be a power of two
+	constexpr uint32_t const MIX_SAMPLES = 128; //number of samples mixed at once; ramps and panning update once per this many samples
+	uint32_t callback_samples = 1024; //number of samples to mix per call of mix_audio callback (a multiple of MIX_SAMPLES; set by Sound::init); n.b. SDL requires this to be a power of two
 
 	//The audio device:
 	SDL_AudioDeviceID device = 0;
 
-	//list of all currently playing samples:
-	std::list< std::shared_ptr< Sound::PlayingSample > > playing_samples;
+	//stereo sample, as produced by the mixer:
+	struct LR {
+		float l;
+		float r;
+	};
+	static_assert(sizeof(LR) == 8, "Sample is packed");
+
+	struct VoiceDecoder; //defined below
+
+	//Voices hold the playback state of each playing sample:
+	struct Voice {
+		float const *data = nullptr; //sample data being played
+		int16_t const *int16_data = nullptr; //...or, for Int16-format samples, this
+		uint8_t const *adpcm_data = nullptr; //...or, for ADPCM-format samples, this
+		//the ADPCM block most recently decoded (-1U if none), so each block is only decoded once per pass:
+		uint32_t adpcm_block = -1U;
+		std::array< float, AdpcmBlockSamples > adpcm_decoded;
+		uint32_t length = 0; //number of values in data
+		Sound::Stream const *stream = nullptr; //...or stream being played (if not null, 'data' is unused)
+		VoiceDecoder *decoder = nullptr; //...or decoder for the Opus-format sample being played (if not null, 'data' is unused)
+		uint32_t i = 0; //next data value to read
+		uint32_t frac = 0; //..plus this fraction (in 1/2^32ths) of a value, when playing at other rates
+		bool loop = false; //should playback loop after data runs out?
+		bool stopping = false; //is playing stopping?
+		uint64_t start_sample = 0; //mix_clock time to start playing at (voices started with play_at wait until then)
+		Sound::Bus bus = Sound::Bus::SFX; //bus the voice is mixed into
+
+		//voice limiting (see Sound::set_voice_limit):
+		float priority = 0.0f; //higher-priority voices are mixed first when over the limit
+		bool is_virtual = false; //was the voice advanced without mixing last block?
+		bool fresh = true; //has the voice not been through a block yet?
+
+		Sound::Ramp< float > volume = Sound::Ramp< float >(1.0f);
+
+		//playback rate (1.0 == normal speed; not used for streams):
+		Sound::Ramp< float > rate = Sound::Ramp< float >(1.0f);
+		float rate_scale = 1.0f; //sample's rate / AUDIO_RATE
+
+		//2D playback panning control: ('NaN' if sound played in 3D mode)
+		Sound::Ramp< float > pan = Sound::Ramp< float >(std::numeric_limits< float >::quiet_NaN());
+
+		//3D playback panning control: ('NaN' if sound played in 2D mode)
+		Sound::Ramp< glm::vec3 > position = Sound::Ramp< glm::vec3 >(std::numeric_limits< float >::quiet_NaN());
+		Sound::Ramp< float > half_volume_radius = Sound::Ramp< float >(std::numeric_limits< float >::quiet_NaN());
+
+		//incremented by the mixer when the voice finishes; handles compare against this:
+		std::atomic< uint32_t > generation{0};
+	};
+
+	//Fixed-size pool of voices, allocated once:
+	// a voice slot is owned by the game thread while free, and by the mixer from its 'Play' command until it finishes.
+	constexpr uint32_t const MAX_VOICES = 1024;
+	std::array< Voice, MAX_VOICES > voices;
+
+	//indices of voices currently being mixed (only touched by the mixer):
+	std::array< uint32_t, MAX_VOICES > active_voices;
+	uint32_t active_count = 0;
+
+	//number of samples mixed so far (only touched by the mixer):
+	uint64_t mix_clock = 0;
+	//..as of the end of the last block mixed (only stored by the mixer; read by Sound::audio_time):
+	std::atomic< uint64_t > audio_clock(0);
+
+	//voice limiting (only touched by the mixer; set with Sound::set_voice_limit):
+	uint32_t real_voice_limit = 64; //most non-stream voices to mix at once
+	float audibility_threshold = 1.0e-3f; //voices quieter than this (-60dB) aren't mixed
+
+	//buses (only touched by the mixer; set with Sound::set_bus_volume, Sound::add_bus_effect, ...):
+	constexpr uint32_t const MAX_BUS_EFFECTS = 4;
+	struct BusState {
+		Sound::Ramp< float > volume = Sound::Ramp< float >(1.0f);
+		std::array< Sound::Effect *, MAX_BUS_EFFECTS > effects{}; //applied in order
+		uint32_t effect_count = 0;
+	};
+	std::array< BusState, Sound::BusCount > buses;
+
+	//instrumentation (only stored by the mixer; read by Sound::get_mix_stats):
+	struct MixCounters {
+		std::array< std::atomic< uint32_t >, Sound::MixStats::HistogramBuckets > histogram;
+		std::atomic< uint32_t > callbacks{0};
+		std::atomic< uint64_t > total_mix_ns{0};
+		std::atomic< uint32_t > last_mix_ns{0};
+		std::atomic< uint32_t > peak_mix_ns{0};
+		std::atomic< uint32_t > active_voices{0};
+		std::atomic< uint32_t > real_voices{0};
+		std::atomic< uint32_t > peak_voices{0};
+		std::atomic< uint32_t > voices_added{0};
+		std::atomic< uint32_t > voices_removed{0};
+		std::atomic< uint32_t > late_callbacks{0};
+		std::atomic< uint32_t > underruns{0};
+	} mix_counters;
+
+	//start time of the previous device callback (for counting late callbacks; only touched by audio_callback and Sound::init):
+	std::chrono::steady_clock::time_point previous_callback;
+	bool have_previous_callback = false;
+
+	//(mixer-only) helper: add to a counter only the mixer stores:
+	inline void bump(std::atomic< uint32_t > &counter, uint32_t amount = 1) {
+		counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+	//The block being mixed (set up by mix_block; read by mix_group on the mixer and MixPool threads):
+	// active voices are split into 'groups' contiguous groups, each mixed into its own buffer, then summed.
+	constexpr uint32_t const MAX_MIX_GROUPS = 8;
+	constexpr uint32_t const MIN_VOICES_PER_GROUP = 32; //smaller groups aren't worth handing to another thread
+	struct Block {
+		uint64_t start = 0; //block covers mix_clock times [start, end)
+		uint64_t end = 0;
+		std::array< LR, MAX_VOICES > start_pans, end_pans; //per-active-voice gains at the start and end of the block
+		std::array< uint8_t, MAX_VOICES > mix_voice; //is the voice mixed ("real") this block?
+		std::array< uint8_t, MAX_VOICES > mixed; //..was it mixed at all (including fading out before going virtual)?
+		std::array< uint8_t, MAX_VOICES > finished; //..did it finish?
+		uint32_t groups = 1;
+		//each group mixes into its own buffer per bus (cleared the first time it's used in a block):
+		std::array< std::array< std::array< LR, MIX_SAMPLES >, Sound::BusCount >, MAX_MIX_GROUPS > buffers;
+		std::array< std::array< uint8_t, Sound::BusCount >, MAX_MIX_GROUPS > used; //was buffers[group][bus] used this block?
+		//scratch space for samples decoded from Int16 format:
+		std::array< std::array< float, AdpcmBlockSamples >, MAX_MIX_GROUPS > decoded;
+		//scratch space for the samples read by the resampler:
+		std::array< std::array< float, uint32_t(MIX_SAMPLES * ResampleMaxStep) + ResampleTaps + 2 >, MAX_MIX_GROUPS > window;
+	} current_block;
+
+	//Worker threads that mix voice groups (only used by the mixer; see Sound::init's 'mix_workers'):
+	struct MixPool {
+		explicit MixPool(uint32_t workers);
+		~MixPool();
+		//mix groups [0, groups) of current_block -- group 0 on the calling thread, the rest on workers -- and wait for them:
+		void run(uint32_t groups);
+
+		std::vector< std::thread > threads;
+		std::mutex mutex;
+		std::condition_variable wake;
+		uint32_t generation = 0; //incremented (under mutex) for every run
+		uint32_t groups = 0; //groups in the current run
+		bool quit = false;
+		std::atomic< uint32_t > remaining{0}; //worker groups not yet finished
+	};
+	std::unique_ptr< MixPool > mix_pool;
+
+	//Pre-mixing (see Sound::init's 'mix_workers'):
+	// a thread mixes ahead of the audio callback into a ring of ready samples, which the callback just copies out.
+	constexpr uint32_t const PREMIX_BUFFERS = 2; //callback-sized buffers to keep ready
+	struct Premix {
+		std::thread thread;
+		std::mutex mutex; //held by the pre-mix thread while mixing (and by Sound::lock)
+		std::condition_variable wake; //only notified by Sound::shutdown (the callback never notifies; the pre-mix thread polls)
+		std::atomic< bool > quit{false};
+		std::vector< LR > ring; //n.b. size is a power of two
+		std::atomic< uint32_t > written{0}; //samples written (only stored by the pre-mix thread)
+		std::atomic< uint32_t > read{0}; //samples read (only stored by the callback)
+	};
+	std::unique_ptr< Premix > premix;
+
+	//Opus-format samples are decoded for each voice that plays them (see Sound::Sample::Format::Opus):
+	// a voice plays the sample's opus_head and then whatever its decoder has put in 'buffer' --
+	// which starts right after opus_head and, for looping voices, wraps around to the start of the file.
+	constexpr uint32_t const OPUS_HEAD_SAMPLES = 9600; //(200ms; long enough for the decoder to get going)
+	struct VoiceDecoder {
+		//a decoder is claimed by the game thread (Free -> Starting), opened and run by the decoder thread (Starting -> Decoding),
+		// released by the mixer when its voice finishes (-> Releasing), and then closed by the decoder thread (-> Free):
+		enum State : uint8_t { Free, Starting, Decoding, Releasing };
+		std::atomic< uint8_t > state{Free};
+
+		Sound::Sample const *sample = nullptr; //(set by the game thread before Starting)
+		bool loop = false;
+
+		std::unique_ptr< OpusReader > reader; //(only touched by the decoder thread)
+
+		//decoded samples are handed from the decoder thread to the mixer through this ring buffer:
+		static constexpr uint32_t BufferSize = 1 << 13; //(about 170ms of audio; n.b. must be a power of two)
+		std::vector< float > buffer; //(allocated the first time the decoder is claimed)
+		std::atomic< uint32_t > written{0}; //count of samples decoded (only stored by the decoder thread)
+		std::atomic< uint32_t > read{0}; //count of samples mixed (only stored by the mixer)
+		std::atomic< bool > finished{false}; //has decoding reached the end of the file (and not looped)?
+	};
+	constexpr uint32_t const MAX_VOICE_DECODERS = 32;
+	std::array< VoiceDecoder, MAX_VOICE_DECODERS > voice_decoders;
+
+	//The thread that runs all of the voice decoders (started when the first one is claimed):
+	struct DecoderThread {
+		DecoderThread();
+		~DecoderThread();
+		std::thread thread;
+		std::atomic< bool > quit{false};
+	};
+	std::unique_ptr< DecoderThread > decoder_thread;
+
+	//voice indices available for new samples (only touched by the game thread):
+	uint32_t unused_voices = 0; //voices [unused_voices, MAX_VOICES) have never been handed out
+	std::vector< uint32_t > free_voices;
+
+	//single-producer (mixer), single-consumer (game thread) ring of finished voice indices:
+	// (can never overflow, since there are only MAX_VOICES voices)
+	std::array< uint32_t, MAX_VOICES > finished_voices;
+	std::atomic< uint32_t > finished_write(0); //(only stored by the mixer)
+	std::atomic< uint32_t > finished_read(0); //(only stored by the game thread)
+
+	//Commands are how the game thread talks to the mixer:
+	struct Command {
+		enum Type : uint8_t {
+			Play, //start mixing voice 'playing_sample'
+			SetVolume, //'playing_sample' volume -> 'value'
+			SetPan, //'playing_sample' pan -> 'value'
+			SetPosition, //'playing_sample' position -> 'position'
+			SetHalfVolumeRadius, //'playing_sample' half volume radius -> 'value'
+			Stop, //fade out 'playing_sample'
+			StopAll, //fade out everything
+			SetGlobalVolume, //Sound::volume -> 'value'
+			SetListener, //Sound::listener -> 'position', 'right'
+			SetPriority, //'playing_sample' priority -> 'value'
+			SetRate, //'playing_sample' rate -> 'value'
+			SetVoiceLimit, //real_voice_limit -> 'count', audibility_threshold -> 'value'
+			ResetStats, //zero mix_stats
+			SetBusVolume, //bus 'count' volume -> 'value'
+			AddBusEffect, //append 'effect' to bus 'count'
+			ClearBusEffects, //remove all effects from bus 'count'
+		} type = Play;
+		Sound::PlayingSample playing_sample; //handle of target voice
+
+		glm::vec3 position = glm::vec3(0.0f);
+		glm::vec3 right = glm::vec3(0.0f);
+		float value = 0.0f;
+		float ramp = 0.0f;
+		uint32_t count = 0;
+		Sound::Effect *effect = nullptr;
+	};
+
+	//single-producer (game thread), single-consumer (mixer) ring of commands:
+	constexpr uint32_t const COMMAND_QUEUE_SIZE = 4096; //n.b. must be a power of two
+	std::array< Command, COMMAND_QUEUE_SIZE > command_queue;
+	std::atomic< uint32_t > command_write(0); //count of commands written (only stored by the game thread)
+	std::atomic< uint32_t > command_read(0); //count of commands read (only stored by the mixer)
 
 }
 
@@ -35,25 +275,220 @@ Sound::Listener Sound::listener;
 
 //This audio-mixing callback is defined below:
 void mix_audio(void *, Uint8 *buffer_, int len);
+//..and is called by SDL through this wrapper, which also checks that callbacks arrive on time:
+void audio_callback(void *, Uint8 *buffer, int len);
+
+//..as are the mixing helpers it uses:
+void mix_chunk(LR *buffer, uint32_t blocks);
+void mix_group(uint32_t group);
+
+//These command queue helpers are also defined below:
+void push_command(Command const &command);
+void drain_commands();
 
 //------------------------ public-facing --------------------------------
 
-Sound::Sample::Sample(std::string const &filename) {
+Sound::Sample::Sample(std::string const &filename, Format format_) {
+	if (format_ == Format::Opus) {
+		if (!(filename.size() >= 5 && filename.substr(filename.size()-5) == ".opus")) {
+			throw std::runtime_error("Sample '" + filename + "' can't be kept in Opus format since it doesn't end in \".opus\".");
+		}
+		//keep the file as-is, and decode just enough to start playing:
+		MappedFile file(filename);
+		opus_data.assign(reinterpret_cast< uint8_t const * >(file.data), reinterpret_cast< uint8_t const * >(file.data) + file.size);
+		OpusReader reader(filename, opus_data.data(), opus_data.size());
+		opus_count = size_t(reader.length());
+		opus_head.resize(std::min< size_t >(opus_count, OPUS_HEAD_SAMPLES));
+		opus_head.resize(reader.read(opus_head.data(), uint32_t(opus_head.size())));
+		format = Format::Opus;
+		return;
+	}
 	if (filename.size() >= 4 && filename.substr(filename.size()-4) == ".wav") {
-		load_wav(filename, &data);
+		load_wav(filename, &data, &rate);
 	} else if (filename.size() >= 5 && filename.substr(filename.size()-5) == ".opus") {
-		load_opus(filename, &data);
+		//decoding is slow, so use previously-decoded samples if they are available:
+		mapped = pcm_cache_lookup(filename, &mapped_samples, &mapped_count);
+		if (!mapped) {
+			load_opus(filename, &data);
+			pcm_cache_store(filename, data);
+		}
 	} else {
 		throw std::runtime_error("Sample '" + filename + "' doesn't end in either \".png\" or \".opus\" -- unsure how to load.");
 	}
+	set_format(format_);
+}
+
+Sound::Sample::Sample(std::vector< float > const &data_, Format format_, uint32_t rate_) : rate(rate_), data(data_) {
+	set_format(format_);
+}
+
+Sound::Sample::~Sample() {
+}
+
+size_t Sound::Sample::size() const {
+	if (format == Format::Int16) return int16_data.size();
+	else if (format == Format::ADPCM) return adpcm_count;
+	else if (format == Format::Opus) return opus_count;
+	else return mapped ? mapped_count : data.size();
+}
+
+size_t Sound::Sample::memory_size() const {
+	if (format == Format::Int16) return int16_data.size() * sizeof(int16_t);
+	else if (format == Format::ADPCM) return adpcm_data.size();
+	else if (format == Format::Opus) return opus_data.size() + opus_head.size() * sizeof(float);
+	else return size() * sizeof(float);
+}
+
+void Sound::Sample::set_format(Format format_) {
+	if (format_ == format) return;
+	assert(format == Format::Float && "Can only re-encode from float.");
+	if (format_ == Format::Opus) {
+		throw std::runtime_error("Samples can only be kept in Opus format when loaded from '.opus' files.");
+	}
+
+	if (format_ == Format::Int16) {
+		encode_int16(samples(), size(), &int16_data);
+	} else if (format_ == Format::ADPCM) {
+		adpcm_count = size();
+		encode_adpcm(samples(), adpcm_count, &adpcm_data);
+	}
+	format = format_;
+
+	//float data is no longer needed:
+	data.clear();
+	data.shrink_to_fit();
+	mapped.reset();
+	mapped_samples = nullptr;
+	mapped_count = 0;
+}
+
+//------------------
+
+Sound::Stream::Stream(std::string const &filename) {
+	if (!(filename.size() >= 5 && filename.substr(filename.size()-5) == ".opus")) {
+		throw std::runtime_error("Stream '" + filename + "' doesn't end in \".opus\" -- unsure how to load.");
+	}
+	reader.reset(new OpusReader(filename));
+	buffer.resize(BufferSize);
+
+	thread = std::thread([this](){
+		//decode in modest chunks so the mixer sees new data promptly:
+		constexpr uint32_t const Chunk = 4096;
+		bool just_rewound = false;
+		while (!quit.load(std::memory_order_relaxed)) {
+			uint32_t write = written.load(std::memory_order_relaxed);
+			uint32_t space = BufferSize - (write - read.load(std::memory_order_acquire));
+			if (space < Chunk || finished.load(std::memory_order_relaxed)) {
+				//buffer is full (or file is done); check back later:
+				if (finished.load(std::memory_order_relaxed) && loop.load(std::memory_order_relaxed)) {
+					finished.store(false, std::memory_order_relaxed);
+				} else {
+					std::this_thread::sleep_for(std::chrono::milliseconds(5));
+				}
+				continue;
+			}
+			uint32_t offset = write & (BufferSize - 1);
+			uint32_t count = std::min(Chunk, BufferSize - offset);
+			try {
+				uint32_t got = reader->read(buffer.data() + offset, count);
+				if (got == 0) {
+					//reached end of file; wrap around if looping (and the file isn't empty):
+					if (loop.load(std::memory_order_relaxed) && !just_rewound) {
+						reader->rewind();
+						just_rewound = true;
+					} else {
+						finished.store(true, std::memory_order_release);
+					}
+					continue;
+				}
+				just_rewound = false;
+				written.store(write + got, std::memory_order_release);
+			} catch (std::exception &e) {
+				std::cerr << "WARNING: stopping stream: " << e.what() << std::endl;
+				finished.store(true, std::memory_order_release);
+				break;
+			}
+		}
+	});
 }
 
-Sound::Sample::Sample(std::vector< float > const &data_) : data(data_) {
+Sound::Stream::~Stream() {
+	quit = true;
+	if (thread.joinable()) thread.join();
 }
 
+DecoderThread::DecoderThread() {
+	thread = std::thread([this](){
+		//decode in small chunks, round-robin, so that every voice stays ahead of the mixer:
+		constexpr uint32_t const Chunk = 1920;
+		while (!quit.load(std::memory_order_relaxed)) {
+			bool busy = false;
+			for (auto &decoder : voice_decoders) {
+				uint8_t state = decoder.state.load(std::memory_order_acquire);
+				if (state == VoiceDecoder::Releasing) {
+					decoder.reader.reset();
+					decoder.state.store(VoiceDecoder::Free, std::memory_order_release);
+					continue;
+				}
+				try {
+					if (state == VoiceDecoder::Starting) {
+						//open the sample and skip the part the mixer will play from opus_head:
+						Sound::Sample const &sample = *decoder.sample;
+						decoder.reader.reset(new OpusReader("Opus-format sample", sample.opus_data.data(), sample.opus_data.size()));
+						decoder.reader->seek(sample.opus_head.size());
+						//(the mixer may have released the decoder already, so only move on from Starting)
+						uint8_t starting = VoiceDecoder::Starting;
+						decoder.state.compare_exchange_strong(starting, VoiceDecoder::Decoding, std::memory_order_acq_rel);
+						busy = true;
+						continue;
+					}
+					if (state != VoiceDecoder::Decoding || decoder.finished.load(std::memory_order_relaxed)) continue;
+
+					uint32_t write = decoder.written.load(std::memory_order_relaxed);
+					uint32_t space = VoiceDecoder::BufferSize - (write - decoder.read.load(std::memory_order_acquire));
+					if (space < Chunk) continue;
+					uint32_t offset = write & (VoiceDecoder::BufferSize - 1);
+					uint32_t count = std::min(Chunk, VoiceDecoder::BufferSize - offset);
+					uint32_t got = decoder.reader->read(decoder.buffer.data() + offset, count);
+					if (got == 0) {
+						//reached end of file; wrap around if looping:
+						// (samples short enough to fit in opus_head never get a decoder, so the file isn't empty)
+						if (decoder.loop) decoder.reader->rewind();
+						else decoder.finished.store(true, std::memory_order_release);
+					} else {
+						decoder.written.store(write + got, std::memory_order_release);
+					}
+					busy = true;
+				} catch (std::exception &e) {
+					std::cerr << "WARNING: stopping Opus-format sample: " << e.what() << std::endl;
+					uint8_t starting = VoiceDecoder::Starting;
+					decoder.state.compare_exchange_strong(starting, VoiceDecoder::Decoding, std::memory_order_acq_rel);
+					decoder.finished.store(true, std::memory_order_release);
+				}
+			}
+			if (!busy) {
+				//every decoder is full (or idle); check back later:
+				std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			}
+		}
+	});
+}
+
+DecoderThread::~DecoderThread() {
+	quit = true;
+	if (thread.joinable()) thread.join();
+}
+
+
 
+void Sound::init(Latency latency, uint32_t mix_workers) {
+	callback_samples = uint32_t(latency);
+	assert(callback_samples % MIX_SAMPLES == 0);
+
+	if (mix_workers > 0) {
+		mix_pool.reset(new MixPool(std::min(mix_workers, MAX_MIX_GROUPS - 1)));
+	}
 
-void Sound::init() {
 	if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
 		std::cerr << "Failed to initialize SDL audio subsytem:\n" << SDL_GetError() << std::endl;
 		std::cerr << "  (Will continue without audio.)\n" << std::endl;
@@ -66,17 +501,46 @@ void Sound::init() {
 	want.freq = AUDIO_RATE;
 	want.format = AUDIO_F32SYS;
 	want.channels = 2;
-	want.samples = MIX_SAMPLES;
-	want.callback = mix_audio;
+	want.samples = uint16_t(callback_samples);
+	want.callback = audio_callback;
 
+	have_previous_callback = false; //(in case an earlier device was open)
 	device = SDL_OpenAudioDevice(nullptr, 0, &want, &have, 0);
 	if (device == 0) {
 		std::cerr << "Failed to open audio device:\n" << SDL_GetError() << std::endl;
 		std::cerr << "  (Will continue without audio.)\n" << std::endl;
 	} else {
+		if (mix_pool) {
+			//mix ahead of the callback on a separate thread:
+			premix.reset(new Premix);
+			premix->ring.resize(PREMIX_BUFFERS * callback_samples);
+			premix->thread = std::thread([](){
+				uint32_t const size = uint32_t(premix->ring.size());
+				assert((size & (size - 1)) == 0); //ring size should be a power of two
+				while (!premix->quit.load(std::memory_order_relaxed)) {
+					uint32_t write = premix->written.load(std::memory_order_relaxed);
+					if (size - (write - premix->read.load(std::memory_order_acquire)) < callback_samples) {
+						//ring is full; check again shortly:
+						// (the callback doesn't wake this thread, since notifying can make a system call on the realtime thread;
+						//  a 1ms poll is well under the shortest buffer, so the ring still refills in time)
+						std::unique_lock< std::mutex > lock(premix->mutex);
+						premix->wake.wait_for(lock, std::chrono::milliseconds(1));
+						continue;
+					}
+					{
+						std::unique_lock< std::mutex > lock(premix->mutex);
+						mix_chunk(&premix->ring[write & (size - 1)], callback_samples / MIX_SAMPLES);
+					}
+					premix->written.store(write + callback_samples, std::memory_order_release);
+				}
+			});
+		}
+
 		//start audio playback:
 		SDL_PauseAudioDevice(device, 0);
-		std::cout << "Audio output initialized." << std::endl;
+		std::cout << "Audio output initialized (" << callback_samples << "-sample buffer, " << (1000.0f * callback_samples / AUDIO_RATE) << "ms";
+		if (premix) std::cout << "; pre-mixing with " << (mix_pool->threads.size() + 1) << " threads";
+		std::cout << ")." << std::endl;
 	}
 }
 
@@ -88,125 +552,600 @@ void Sound::shutdown() {
 		SDL_CloseAudioDevice(device);
 		device = 0;
 	}
+	if (premix) {
+		premix->quit = true;
+		premix->wake.notify_one();
+		if (premix->thread.joinable()) premix->thread.join();
+		premix.reset();
+	}
+	mix_pool.reset();
+	decoder_thread.reset();
 }
 
 
+Sound::MixStats Sound::get_mix_stats() {
+	MixStats stats;
+	stats.callbacks = mix_counters.callbacks.load(std::memory_order_acquire);
+	for (uint32_t b = 0; b < MixStats::HistogramBuckets; ++b) {
+		stats.histogram[b] = mix_counters.histogram[b].load(std::memory_order_relaxed);
+	}
+	float block_ns = float(callback_samples) * 1.0e9f / float(AUDIO_RATE);
+	stats.last_budget_used = float(mix_counters.last_mix_ns.load(std::memory_order_relaxed)) / block_ns;
+	stats.peak_budget_used = float(mix_counters.peak_mix_ns.load(std::memory_order_relaxed)) / block_ns;
+	if (stats.callbacks) {
+		stats.average_budget_used = float(mix_counters.total_mix_ns.load(std::memory_order_relaxed)) / block_ns / float(stats.callbacks);
+	}
+	stats.active_voices = mix_counters.active_voices.load(std::memory_order_relaxed);
+	stats.real_voices = mix_counters.real_voices.load(std::memory_order_relaxed);
+	stats.peak_voices = mix_counters.peak_voices.load(std::memory_order_relaxed);
+	stats.voices_added = mix_counters.voices_added.load(std::memory_order_relaxed);
+	stats.voices_removed = mix_counters.voices_removed.load(std::memory_order_relaxed);
+	stats.late_callbacks = mix_counters.late_callbacks.load(std::memory_order_relaxed);
+	stats.underruns = mix_counters.underruns.load(std::memory_order_relaxed);
+	return stats;
+}
+
+void Sound::reset_mix_stats() {
+	Command command;
+	command.type = Command::ResetStats;
+	push_command(command);
+}
+
+void Sound::mix_offline(uint32_t blocks, std::vector< float > *out) {
+	if (device != 0) {
+		throw std::runtime_error("Sound::mix_offline can't be used while an audio device is open.");
+	}
+	std::vector< float > block(2 * callback_samples);
+	if (out) out->reserve(out->size() + size_t(blocks) * block.size());
+	for (uint32_t b = 0; b < blocks; ++b) {
+		mix_audio(nullptr, reinterpret_cast< Uint8 * >(block.data()), int(block.size() * sizeof(float)));
+		if (out) out->insert(out->end(), block.begin(), block.end());
+	}
+}
+
+uint32_t Sound::block_samples() {
+	return callback_samples;
+}
+
+void Sound::set_offline_latency(Latency latency) {
+	if (device != 0) {
+		throw std::runtime_error("Sound::set_offline_latency can't be used while an audio device is open.");
+	}
+	callback_samples = uint32_t(latency);
+	assert(callback_samples % MIX_SAMPLES == 0);
+}
+
+void Sound::set_offline_mix_workers(uint32_t mix_workers) {
+	if (device != 0) {
+		throw std::runtime_error("Sound::set_offline_mix_workers can't be used while an audio device is open.");
+	}
+	mix_pool.reset();
+	if (mix_workers > 0) {
+		mix_pool.reset(new MixPool(std::min(mix_workers, MAX_MIX_GROUPS - 1)));
+	}
+}
+
 void Sound::lock() {
-	if (device) SDL_LockAudioDevice(device);
+	//(when pre-mixing, the mixer runs on the pre-mix thread, not in the callback)
+	if (premix) premix->mutex.lock();
+	else if (device) SDL_LockAudioDevice(device);
 }
 
 void Sound::unlock() {
-	if (device) SDL_UnlockAudioDevice(device);
+	if (premix) premix->mutex.unlock();
+	else if (device) SDL_UnlockAudioDevice(device);
+}
+
+//------------------
+
+MixPool::MixPool(uint32_t workers) {
+	for (uint32_t w = 0; w < workers; ++w) {
+		threads.emplace_back([this, w](){
+			uint32_t const group = w + 1; //(group 0 is mixed by the thread calling run)
+			uint32_t seen = 0;
+			std::unique_lock< std::mutex > lock(mutex);
+			while (true) {
+				wake.wait(lock, [&](){ return quit || generation != seen; });
+				if (quit) break;
+				seen = generation;
+				if (group >= groups) continue; //not needed this time
+				lock.unlock();
+				mix_group(group);
+				remaining.fetch_sub(1, std::memory_order_acq_rel);
+				lock.lock();
+			}
+		});
+	}
+}
+
+MixPool::~MixPool() {
+	{
+		std::unique_lock< std::mutex > lock(mutex);
+		quit = true;
+	}
+	wake.notify_all();
+	for (auto &thread : threads) {
+		thread.join();
+	}
 }
 
-std::shared_ptr< Sound::PlayingSample > Sound::play(Sample const &sample, float volume, float pan) {
-	std::shared_ptr< Sound::PlayingSample > playing_sample = std::make_shared< Sound::PlayingSample >(sample, volume, pan, false);
-	lock();
-	playing_samples.emplace_back(playing_sample);
-	unlock();
-	return playing_sample;
+void MixPool::run(uint32_t groups_) {
+	assert(groups_ >= 1 && groups_ <= threads.size() + 1);
+	remaining.store(groups_ - 1, std::memory_order_relaxed);
+	{
+		std::unique_lock< std::mutex > lock(mutex);
+		groups = groups_;
+		generation += 1;
+	}
+	wake.notify_all();
+	mix_group(0);
+	//(workers finish at about the same time as group 0, so just spin)
+	while (remaining.load(std::memory_order_acquire) != 0) {
+		std::this_thread::yield();
+	}
 }
 
-std::shared_ptr< Sound::PlayingSample > Sound::play_3D(Sample const &sample, float volume, glm::vec3 const &position, float half_volume_radius) {
-	std::shared_ptr< Sound::PlayingSample > playing_sample = std::make_shared< Sound::PlayingSample >(sample, volume, position, half_volume_radius, false);
-	lock();
-	playing_samples.emplace_back(playing_sample);
-	unlock();
-	return playing_sample;
+//helper: claim a voice from the pool and reset it:
+// (returns nullptr if there are no free voices)
+Voice *allocate_voice(float volume, bool loop, Sound::Bus bus, Sound::PlayingSample *handle) {
+	//reclaim any voices the mixer has finished with:
+	uint32_t read = finished_read.load(std::memory_order_relaxed);
+	uint32_t write = finished_write.load(std::memory_order_acquire);
+	while (read != write) {
+		free_voices.emplace_back(finished_voices[read & (MAX_VOICES - 1)]);
+		read += 1;
+	}
+	finished_read.store(read, std::memory_order_release);
+
+	uint32_t index;
+	if (!free_voices.empty()) {
+		index = free_voices.back();
+		free_voices.pop_back();
+	} else if (unused_voices < MAX_VOICES) {
+		index = unused_voices;
+		unused_voices += 1;
+	} else {
+		std::cerr << "WARNING: all " << MAX_VOICES << " voices are playing; ignoring request to play another sample." << std::endl;
+		return nullptr;
+	}
+
+	Voice &voice = voices[index];
+	voice.data = nullptr;
+	voice.int16_data = nullptr;
+	voice.adpcm_data = nullptr;
+	voice.length = 0;
+	voice.stream = nullptr;
+	voice.decoder = nullptr;
+	voice.i = 0;
+	voice.frac = 0;
+	voice.loop = loop;
+	voice.stopping = false;
+	voice.start_sample = 0;
+	voice.bus = bus;
+	voice.priority = 0.0f;
+	voice.is_virtual = false;
+	voice.fresh = true;
+	voice.volume = Sound::Ramp< float >(volume);
+	voice.rate = Sound::Ramp< float >(1.0f);
+	voice.rate_scale = 1.0f;
+	voice.pan = Sound::Ramp< float >(std::numeric_limits< float >::quiet_NaN());
+	voice.position = Sound::Ramp< glm::vec3 >(std::numeric_limits< float >::quiet_NaN());
+	voice.half_volume_radius = Sound::Ramp< float >(std::numeric_limits< float >::quiet_NaN());
+
+	handle->index = index;
+	handle->generation = voice.generation.load(std::memory_order_relaxed);
+	return &voice;
 }
 
-std::shared_ptr< Sound::PlayingSample > Sound::loop(Sample const &sample, float volume, float pan) {
-	std::shared_ptr< Sound::PlayingSample > playing_sample = std::make_shared< Sound::PlayingSample >(sample, volume, pan, true);
-	lock();
-	playing_samples.emplace_back(playing_sample);
-	unlock();
-	return playing_sample;
+//helper: hand a freshly-allocated voice to the mixer:
+void start_voice(Sound::PlayingSample const &handle) {
+	Command command;
+	command.type = Command::Play;
+	command.playing_sample = handle;
+	push_command(command);
 }
 
+//helper: claim a decoder for a voice playing an Opus-format sample:
+// (returns nullptr if all decoders are busy)
+VoiceDecoder *claim_voice_decoder(Sound::Sample const &sample, bool loop) {
+	for (auto &decoder : voice_decoders) {
+		if (decoder.state.load(std::memory_order_acquire) != VoiceDecoder::Free) continue;
+		decoder.sample = &sample;
+		decoder.loop = loop;
+		if (decoder.buffer.empty()) decoder.buffer.resize(VoiceDecoder::BufferSize);
+		decoder.written.store(0, std::memory_order_relaxed);
+		decoder.read.store(0, std::memory_order_relaxed);
+		decoder.finished.store(false, std::memory_order_relaxed);
+		decoder.state.store(VoiceDecoder::Starting, std::memory_order_release);
+		if (!decoder_thread) decoder_thread.reset(new DecoderThread);
+		return &decoder;
+	}
+	std::cerr << "WARNING: all " << MAX_VOICE_DECODERS << " Opus-format voices are playing; ignoring request to play another." << std::endl;
+	return nullptr;
+}
 
+//helper: point a voice at a sample's data:
+// (returns false if the sample can't be played right now -- or ever, if it is empty)
+bool set_voice_sample(Voice *voice, Sound::Sample const &sample) {
+	//an empty sample has nothing to play (and a looping voice on one would never finish its mix loop):
+	if (sample.size() == 0) return false;
+	if (sample.format == Sound::Sample::Format::Int16) {
+		voice->int16_data = sample.int16_data.data();
+	} else if (sample.format == Sound::Sample::Format::ADPCM) {
+		voice->adpcm_data = sample.adpcm_data.data();
+		voice->adpcm_block = -1U;
+	} else if (sample.format == Sound::Sample::Format::Opus) {
+		if (sample.opus_head.size() >= sample.opus_count) {
+			//short enough to be entirely decoded already:
+			voice->data = sample.opus_head.data();
+		} else {
+			voice->decoder = claim_voice_decoder(sample, voice->loop);
+			if (!voice->decoder) return false;
+		}
+	} else {
+		voice->data = sample.samples();
+	}
+	voice->length = uint32_t(sample.size());
+	voice->rate_scale = float(sample.rate) / float(AUDIO_RATE);
+	return true;
+}
 
-std::shared_ptr< Sound::PlayingSample > Sound::loop_3D(Sample const &sample, float volume, glm::vec3 const &position, float half_volume_radius) {
-	std::shared_ptr< Sound::PlayingSample > playing_sample = std::make_shared< Sound::PlayingSample >(sample, volume, position, half_volume_radius, true);
-	lock();
-	playing_samples.emplace_back(playing_sample);
-	unlock();
-	return playing_sample;
+//helper: give back a voice that was allocated but never started:
+void release_voice(Sound::PlayingSample *handle) {
+	free_voices.emplace_back(handle->index);
+	*handle = Sound::PlayingSample();
 }
 
+//helper: convert a time from Sound::audio_time to a mix_clock sample index:
+// (times that have already passed map to zero, i.e., "as soon as possible")
+uint64_t audio_time_to_sample(double time) {
+	if (!(time > 0.0)) return 0;
+	return uint64_t(std::llround(time * AUDIO_RATE));
+}
 
-void Sound::stop_all_samples() {
-	lock();
-	for (auto &s : playing_samples) {
-		s->stop();
+//helpers: start voices in '2D' or '3D' mode:
+Sound::PlayingSample start_2D(Sound::Sample const &sample, float volume, float pan, bool loop, Sound::Bus bus, uint64_t start_sample = 0) {
+	Sound::PlayingSample handle;
+	if (Voice *voice = allocate_voice(volume, loop, bus, &handle)) {
+		if (!set_voice_sample(voice, sample)) {
+			release_voice(&handle);
+			return handle;
+		}
+		voice->pan = Sound::Ramp< float >(pan);
+		voice->start_sample = start_sample;
+		start_voice(handle);
 	}
-	unlock();
+	return handle;
+}
+
+Sound::PlayingSample start_3D(Sound::Sample const &sample, float volume, glm::vec3 const &position, float half_volume_radius, bool loop, Sound::Bus bus, uint64_t start_sample = 0) {
+	Sound::PlayingSample handle;
+	if (Voice *voice = allocate_voice(volume, loop, bus, &handle)) {
+		if (!set_voice_sample(voice, sample)) {
+			release_voice(&handle);
+			return handle;
+		}
+		voice->start_sample = start_sample;
+		voice->position = Sound::Ramp< glm::vec3 >(position);
+		voice->half_volume_radius = Sound::Ramp< float >(half_volume_radius);
+		start_voice(handle);
+	}
+	return handle;
+}
+
+Sound::PlayingSample start_stream(Sound::Stream const &stream, float volume, float pan, bool loop, Sound::Bus bus) {
+	Sound::PlayingSample handle;
+	if (Voice *voice = allocate_voice(volume, loop, bus, &handle)) {
+		stream.loop.store(loop, std::memory_order_relaxed);
+		voice->stream = &stream;
+		voice->pan = Sound::Ramp< float >(pan);
+		start_voice(handle);
+	}
+	return handle;
+}
+
+Sound::PlayingSample Sound::play(Sample const &sample, float volume, float pan, Bus bus) {
+	return start_2D(sample, volume, pan, false, bus);
+}
+
+Sound::PlayingSample Sound::play_3D(Sample const &sample, float volume, glm::vec3 const &position, float half_volume_radius, Bus bus) {
+	return start_3D(sample, volume, position, half_volume_radius, false, bus);
+}
+
+Sound::PlayingSample Sound::play_at(Sample const &sample, double time, float volume, float pan, Bus bus) {
+	return start_2D(sample, volume, pan, false, bus, audio_time_to_sample(time));
+}
+
+Sound::PlayingSample Sound::play_3D_at(Sample const &sample, double time, float volume, glm::vec3 const &position, float half_volume_radius, Bus bus) {
+	return start_3D(sample, volume, position, half_volume_radius, false, bus, audio_time_to_sample(time));
+}
+
+double Sound::audio_time() {
+	return double(audio_clock.load(std::memory_order_acquire)) / double(AUDIO_RATE);
+}
+
+Sound::PlayingSample Sound::loop(Sample const &sample, float volume, float pan, Bus bus) {
+	return start_2D(sample, volume, pan, true, bus);
+}
+
+Sound::PlayingSample Sound::loop_3D(Sample const &sample, float volume, glm::vec3 const &position, float half_volume_radius, Bus bus) {
+	return start_3D(sample, volume, position, half_volume_radius, true, bus);
+}
+
+Sound::PlayingSample Sound::play_stream(Stream const &stream, float volume, float pan, Bus bus) {
+	return start_stream(stream, volume, pan, false, bus);
+}
+
+Sound::PlayingSample Sound::loop_stream(Stream const &stream, float volume, float pan, Bus bus) {
+	return start_stream(stream, volume, pan, true, bus);
+}
+
+void Sound::stop_all_samples() {
+	Command command;
+	command.type = Command::StopAll;
+	push_command(command);
+}
+
+void Sound::set_bus_volume(Bus bus, float new_volume, float ramp) {
+	Command command;
+	command.type = Command::SetBusVolume;
+	command.count = uint32_t(bus);
+	command.value = new_volume;
+	command.ramp = ramp;
+	push_command(command);
+}
+
+void Sound::add_bus_effect(Bus bus, Effect *effect) {
+	assert(effect);
+	Command command;
+	command.type = Command::AddBusEffect;
+	command.count = uint32_t(bus);
+	command.effect = effect;
+	push_command(command);
+}
+
+void Sound::clear_bus_effects(Bus bus) {
+	Command command;
+	command.type = Command::ClearBusEffects;
+	command.count = uint32_t(bus);
+	push_command(command);
+}
+
+void Sound::set_voice_limit(uint32_t max_real_voices, float audibility_threshold) {
+	Command command;
+	command.type = Command::SetVoiceLimit;
+	command.count = max_real_voices;
+	command.value = audibility_threshold;
+	push_command(command);
 }
 
 void Sound::set_volume(float new_volume, float ramp) {
-	lock();
-	volume.set(new_volume, ramp);
-	unlock();
+	Command command;
+	command.type = Command::SetGlobalVolume;
+	command.value = new_volume;
+	command.ramp = ramp;
+	push_command(command);
 }
 
 //------------------
 
-void Sound::PlayingSample::set_volume(float new_volume, float ramp) {
-	Sound::lock();
-	if (!stopping) {
-		volume.set(new_volume, ramp);
-	}
-	Sound::unlock();
+//helper: queue a command that refers to a playing sample:
+void push_sample_command(Sound::PlayingSample const &playing_sample, Command &command) {
+	if (!playing_sample) return; //null handles don't refer to anything
+	command.playing_sample = playing_sample;
+	push_command(command);
 }
 
-void Sound::PlayingSample::set_pan(float new_pan, float ramp) {
-	if (!(pan.value == pan.value)) return; //ignore if not in '2D' mode
-	Sound::lock();
-	pan.set(new_pan, ramp);
-	Sound::unlock();
+void Sound::PlayingSample::set_volume(float new_volume, float ramp) const {
+	Command command;
+	command.type = Command::SetVolume;
+	command.value = new_volume;
+	command.ramp = ramp;
+	push_sample_command(*this, command);
 }
 
-void Sound::PlayingSample::set_position(glm::vec3 const &new_position, float ramp) {
-	if (pan.value == pan.value) return; //ignore if not in '3D' mode
-	Sound::lock();
-	position.set(new_position, ramp);
-	Sound::unlock();
+void Sound::PlayingSample::set_pan(float new_pan, float ramp) const {
+	Command command;
+	command.type = Command::SetPan;
+	command.value = new_pan;
+	command.ramp = ramp;
+	push_sample_command(*this, command);
 }
 
-void Sound::PlayingSample::set_half_volume_radius(float new_radius, float ramp) {
-	if (pan.value == pan.value) return; //ignore if not in '3D' mode
-	Sound::lock();
-	half_volume_radius.set(new_radius, ramp);
-	Sound::unlock();
+void Sound::PlayingSample::set_position(glm::vec3 const &new_position, float ramp) const {
+	Command command;
+	command.type = Command::SetPosition;
+	command.position = new_position;
+	command.ramp = ramp;
+	push_sample_command(*this, command);
 }
 
-void Sound::PlayingSample::stop(float ramp) {
-	Sound::lock();
-	if (!(stopping || stopped)) {
-		stopping = true;
-		volume.target = 0.0f;
-		volume.ramp = ramp;
-	} else {
-		volume.ramp = std::min(volume.ramp, ramp);
-	}
-	Sound::unlock();
+void Sound::PlayingSample::set_half_volume_radius(float new_radius, float ramp) const {
+	Command command;
+	command.type = Command::SetHalfVolumeRadius;
+	command.value = new_radius;
+	command.ramp = ramp;
+	push_sample_command(*this, command);
+}
+
+void Sound::PlayingSample::set_priority(float priority) const {
+	Command command;
+	command.type = Command::SetPriority;
+	command.value = priority;
+	push_sample_command(*this, command);
+}
+
+void Sound::PlayingSample::set_rate(float new_rate, float ramp) const {
+	Command command;
+	command.type = Command::SetRate;
+	command.value = new_rate;
+	command.ramp = ramp;
+	push_sample_command(*this, command);
+}
+
+void Sound::PlayingSample::stop(float ramp) const {
+	Command command;
+	command.type = Command::Stop;
+	command.ramp = ramp;
+	push_sample_command(*this, command);
+}
+
+bool Sound::PlayingSample::stopped() const {
+	if (index >= MAX_VOICES) return true;
+	return voices[index].generation.load(std::memory_order_acquire) != generation;
 }
 
 //------------------
 
 void Sound::Listener::set_position_right(glm::vec3 const &new_position, glm::vec3 const &new_right, float ramp) {
-	Sound::lock();
-	position.set(new_position, ramp);
+	Command command;
+	command.type = Command::SetListener;
+	command.position = new_position;
 	//some extra code to make sure right is always a unit vector:
 	if (new_right == glm::vec3(0.0f)) {
-		right.set(glm::vec3(1.0f, 0.0f, 0.0f), ramp);
+		command.right = glm::vec3(1.0f, 0.0f, 0.0f);
 	} else {
-		right.set(glm::normalize(new_right), ramp);
+		command.right = glm::normalize(new_right);
 	}
-	Sound::unlock();
+	command.ramp = ramp;
+	push_command(command);
 }
 
 //------------------------ internals --------------------------------
 
+//Command queue protocol:
+// - only the game thread writes commands and advances 'command_write'
+// - only the mixer (or the game thread, while holding the device lock) reads commands and advances 'command_read'
+// so neither side ever waits on the other in the common case.
+
+//(game thread) add a command to the queue:
+void push_command(Command const &command) {
+	uint32_t write = command_write.load(std::memory_order_relaxed);
+	if (write - command_read.load(std::memory_order_acquire) >= COMMAND_QUEUE_SIZE) {
+		//queue is full (mixer is stalled or there is no audio device), so apply queued commands directly:
+		Sound::lock();
+		drain_commands();
+		Sound::unlock();
+	}
+	command_queue[write & (COMMAND_QUEUE_SIZE - 1)] = command;
+	command_write.store(write + 1, std::memory_order_release);
+}
+
+//(mixer) helper: fade out a voice:
+void stop_voice(Voice &voice, float ramp) {
+	if (!voice.stopping) {
+		voice.stopping = true;
+		voice.volume.target = 0.0f;
+		voice.volume.ramp = ramp;
+	} else {
+		voice.volume.ramp = std::min(voice.volume.ramp, ramp);
+	}
+}
+
+//(mixer) apply a single command:
+void apply_command(Command const &command) {
+	if (command.type == Command::StopAll) {
+		for (uint32_t a = 0; a < active_count; ++a) {
+			stop_voice(voices[active_voices[a]], command.ramp);
+		}
+		return;
+	} else if (command.type == Command::SetGlobalVolume) {
+		Sound::volume.set(command.value, command.ramp);
+		return;
+	} else if (command.type == Command::SetListener) {
+		Sound::listener.position.set(command.position, command.ramp);
+		Sound::listener.right.set(command.right, command.ramp);
+		return;
+	} else if (command.type == Command::SetVoiceLimit) {
+		real_voice_limit = std::min(command.count, MAX_VOICES);
+		audibility_threshold = command.value;
+		return;
+	} else if (command.type == Command::SetBusVolume) {
+		assert(command.count < Sound::BusCount);
+		buses[command.count].volume.set(command.value, command.ramp);
+		return;
+	} else if (command.type == Command::AddBusEffect) {
+		assert(command.count < Sound::BusCount);
+		BusState &bus = buses[command.count];
+		if (bus.effect_count < MAX_BUS_EFFECTS) {
+			bus.effects[bus.effect_count++] = command.effect;
+		}
+		return;
+	} else if (command.type == Command::ClearBusEffects) {
+		assert(command.count < Sound::BusCount);
+		buses[command.count].effect_count = 0;
+		return;
+	} else if (command.type == Command::ResetStats) {
+		for (auto &bucket : mix_counters.histogram) bucket.store(0, std::memory_order_relaxed);
+		mix_counters.callbacks.store(0, std::memory_order_relaxed);
+		mix_counters.total_mix_ns.store(0, std::memory_order_relaxed);
+		mix_counters.last_mix_ns.store(0, std::memory_order_relaxed);
+		mix_counters.peak_mix_ns.store(0, std::memory_order_relaxed);
+		mix_counters.peak_voices.store(active_count, std::memory_order_relaxed);
+		mix_counters.voices_added.store(0, std::memory_order_relaxed);
+		mix_counters.voices_removed.store(0, std::memory_order_relaxed);
+		mix_counters.late_callbacks.store(0, std::memory_order_relaxed);
+		mix_counters.underruns.store(0, std::memory_order_relaxed);
+		return;
+	}
+
+	//remaining commands refer to a voice:
+	assert(command.playing_sample.index < MAX_VOICES);
+	Voice &voice = voices[command.playing_sample.index];
+	//ignore commands for voices that have already finished:
+	if (voice.generation.load(std::memory_order_relaxed) != command.playing_sample.generation) return;
+
+	if (command.type == Command::Play) {
+		assert(active_count < MAX_VOICES);
+		active_voices[active_count] = command.playing_sample.index;
+		active_count += 1;
+		bump(mix_counters.voices_added);
+	} else if (command.type == Command::SetVolume) {
+		if (!voice.stopping) {
+			voice.volume.set(command.value, command.ramp);
+		}
+	} else if (command.type == Command::SetPan) {
+		if (!(voice.pan.value == voice.pan.value)) return; //ignore if not in '2D' mode
+		voice.pan.set(command.value, command.ramp);
+	} else if (command.type == Command::SetPosition) {
+		if (voice.pan.value == voice.pan.value) return; //ignore if not in '3D' mode
+		voice.position.set(command.position, command.ramp);
+	} else if (command.type == Command::SetHalfVolumeRadius) {
+		if (voice.pan.value == voice.pan.value) return; //ignore if not in '3D' mode
+		voice.half_volume_radius.set(command.value, command.ramp);
+	} else if (command.type == Command::SetPriority) {
+		voice.priority = command.value;
+	} else if (command.type == Command::SetRate) {
+		voice.rate.set(std::max(0.0f, command.value), command.ramp);
+	} else if (command.type == Command::Stop) {
+		stop_voice(voice, command.ramp);
+	} else {
+		assert(0 && "Unknown command type.");
+	}
+}
+
+//(mixer) apply all pending commands:
+void drain_commands() {
+	uint32_t read = command_read.load(std::memory_order_relaxed);
+	uint32_t write = command_write.load(std::memory_order_acquire);
+	while (read != write) {
+		apply_command(command_queue[read & (COMMAND_QUEUE_SIZE - 1)]);
+		read += 1;
+	}
+	command_read.store(read, std::memory_order_release);
+}
+
+//(mixer) retire a voice -- its handles will report it as stopped and the game thread may reuse its slot:
+void finish_voice(uint32_t index) {
+	voices[index].generation.fetch_add(1, std::memory_order_release);
+
+	uint32_t write = finished_write.load(std::memory_order_relaxed);
+	assert(write - finished_read.load(std::memory_order_acquire) < MAX_VOICES);
+	finished_voices[write & (MAX_VOICES - 1)] = index;
+	finished_write.store(write + 1, std::memory_order_release);
+}
+
+//------------------
 
 //helper: equal-power panning
 inline void compute_pan_weights(float pan, float *left, float *right) {
@@ -219,38 +1158,6 @@ inline void compute_pan_weights(float pan, float *left, float *right) {
 	*right = std::sin(ang);
 }
 
-//helper: 3D audio panning
-void compute_pan_from_listener_and_position(
-	glm::vec3 const &listener_position,
-	glm::vec3 const &listener_right,
-	glm::vec3 const &source_position,
-	float source_half_radius,
-	float *left, float *right
-	) {
-	glm::vec3 to = source_position - listener_position;
-	float distance = glm::length(to);
-	//start by panning based on direction.
-	//note that for a LR fade to sound uniform, sound power (squared magnitude) should remain constant.
-	if (distance == 0.0f) {
-		*left = *right = std::sqrt(2.0f);
-	} else {
-		//amt ranges from -1 (most left) to 1 (most right):
-		float amt = glm::dot(listener_right, to) / distance;
-		//turn into an angle from 0.0f (most left) to pi/2 (most right):
-		float ang = 0.5f * 3.1415926f * (0.5f * (amt + 1.0f));
-		*left = std::cos(ang);
-		*right = std::sin(ang);
-
-		//squared distance attenuation is realistic if there are no walls,
-		// but I'm going to use linear because it's sounds better to me.
-		// (feel free to change it, of course)
-		//want att = 0.5f at distance == half_volume_radius
-		float att = 1.0f / (1.0f + (distance / source_half_radius));
-		*left *= att;
-		*right *= att;
-	}
-}
-
 //helper: ramp updates...
 constexpr float const RAMP_STEP = float(MIX_SAMPLES) / float(AUDIO_RATE);
 
@@ -310,17 +1217,276 @@ void step_direction_ramp(Sound::Ramp< glm::vec3 > &ramp) {
 }
 
 
-//The audio callback -- invoked by SDL when it needs more sound to play:
-void mix_audio(void *, Uint8 *buffer_, int len) {
-	assert(buffer_); //should always have some audio buffer
+//voice counts from one call of mix_block (for instrumentation):
+struct BlockCounts {
+	uint32_t playing = 0; //voices playing during the block
+	uint32_t mixed = 0; //..of which were mixed (rather than virtual)
+	uint32_t finished = 0; //..of which finished
+};
 
-	struct LR {
-		float l;
-		float r;
-	};
-	static_assert(sizeof(LR) == 8, "Sample is packed");
-	assert(len == MIX_SAMPLES * sizeof(LR)); //should always have the expected number of samples
-	LR *buffer = reinterpret_cast< LR * >(buffer_);
+//voices scheduled with play_at wait (without being panned, ramped, or mixed) until their start time is in the block:
+bool waiting(Voice const &voice) {
+	return voice.start_sample >= current_block.end;
+}
+
+//(mix_group) helper: get ADPCM block 'block' of a voice's sample, decoding it only if it isn't the last one decoded:
+float const *voice_adpcm_block(Voice &voice, uint32_t block) {
+	assert(voice.adpcm_data);
+	if (voice.adpcm_block != block) {
+		decode_adpcm_block(voice.adpcm_data + size_t(block) * AdpcmBlockBytes, voice.adpcm_decoded.data());
+		voice.adpcm_block = block;
+	}
+	return voice.adpcm_decoded.data();
+}
+
+//(mix_group) helper: copy a voice's samples [first, first + count) to 'out' as floats:
+// samples before the start or after the end wrap around for looping voices, and are zero otherwise.
+void read_voice_samples(Voice &voice, int64_t first, uint32_t count, float *out) {
+	int64_t const length = voice.length;
+	uint32_t done = 0;
+	while (done < count) {
+		int64_t index = first + done;
+		if (voice.loop) {
+			index %= length;
+			if (index < 0) index += length;
+		} else if (index < 0 || index >= length) {
+			uint32_t zeros = (index < 0 ? uint32_t(std::min< int64_t >(count - done, -index)) : count - done);
+			std::fill(out + done, out + done + zeros, 0.0f);
+			done += zeros;
+			continue;
+		}
+		uint32_t n = uint32_t(std::min< int64_t >(count - done, length - index));
+		if (voice.data) {
+			std::copy(voice.data + index, voice.data + index + n, out + done);
+		} else if (voice.int16_data) {
+			decode_int16(voice.int16_data + index, n, out + done);
+		} else {
+			uint32_t block = uint32_t(index / AdpcmBlockSamples);
+			uint32_t offset = uint32_t(index - int64_t(block) * AdpcmBlockSamples);
+			n = std::min(n, AdpcmBlockSamples - offset);
+			float const *decoded = voice_adpcm_block(voice, block);
+			std::copy(decoded + offset, decoded + offset + n, out + done);
+		}
+		done += n;
+	}
+}
+
+//(mix_group) helper: mix samples from a decoder's ring buffer into buffer[mixed, MIX_SAMPLES), as far as they are available:
+// ('size' is the ring's size, a power of two; 'written' and 'read' count samples put in and taken out; *pan is advanced)
+void mix_from_ring(LR *buffer, uint32_t mixed, float const *ring, uint32_t size, std::atomic< uint32_t > const &written, std::atomic< uint32_t > &read_, LR *pan, LR pan_step) {
+	uint32_t read = read_.load(std::memory_order_relaxed);
+	uint32_t available = written.load(std::memory_order_acquire) - read;
+	while (mixed < MIX_SAMPLES && available > 0) {
+		uint32_t offset = read & (size - 1);
+		uint32_t count = std::min(std::min(MIX_SAMPLES - mixed, available), size - offset);
+		mix_mono_to_stereo(&buffer[mixed].l, ring + offset, count,
+			pan->l, pan->r, pan_step.l, pan_step.r);
+
+		pan->l += pan_step.l * count;
+		pan->r += pan_step.r * count;
+
+		mixed += count;
+		read += count;
+		available -= count;
+	}
+	read_.store(read, std::memory_order_release);
+}
+
+//Mix group 'group' of the active voices in current_block:
+// (called by mix_block, or by MixPool threads; only touches its own voices and buffers)
+void mix_group(uint32_t group) {
+	uint32_t begin = active_count * group / current_block.groups;
+	uint32_t end = active_count * (group + 1) / current_block.groups;
+
+	float *decoded = current_block.decoded[group].data();
+	float *window = current_block.window[group].data();
+
+	for (uint32_t a = begin; a < end; ++a) {
+		Voice &voice = voices[active_voices[a]];
+
+		if (waiting(voice)) {
+			//not started yet; voices stopped before they start are just dropped:
+			current_block.mixed[a] = 0;
+			current_block.finished[a] = voice.stopping;
+			continue;
+		}
+
+		//voices scheduled with play_at start partway through their first block:
+		uint32_t offset = (voice.start_sample > current_block.start ? uint32_t(voice.start_sample - current_block.start) : 0);
+
+		LR start_pan = current_block.start_pans[a];
+		LR end_pan = current_block.end_pans[a];
+
+		//fade in voices that were virtual last block, and fade out voices that are becoming virtual:
+		// (a voice's first block just starts in whichever state it's in)
+		bool mixed = current_block.mix_voice[a];
+		if (!voice.fresh) {
+			if (mixed && voice.is_virtual) start_pan = LR{0.0f, 0.0f};
+			if (!mixed && !voice.is_virtual) {
+				end_pan = LR{0.0f, 0.0f};
+				mixed = true; //mix this block (fading out) before going virtual
+			}
+		}
+		voice.fresh = false;
+		voice.is_virtual = !current_block.mix_voice[a];
+		current_block.mixed[a] = mixed;
+
+		//figure out a step to add at each sample so that pan will move smoothly from start to end:
+		LR pan_step;
+		pan_step.l = (end_pan.l - start_pan.l) / MIX_SAMPLES;
+		pan_step.r = (end_pan.r - start_pan.r) / MIX_SAMPLES;
+		LR pan;
+		pan.l = start_pan.l + pan_step.l * offset;
+		pan.r = start_pan.r + pan_step.r * offset;
+
+		//the group's buffer for the voice's bus:
+		LR *buffer = nullptr;
+		if (mixed) {
+			uint32_t bus = uint32_t(voice.bus);
+			buffer = current_block.buffers[group][bus].data();
+			if (!current_block.used[group][bus]) {
+				current_block.used[group][bus] = 1;
+				for (uint32_t s = 0; s < MIX_SAMPLES; ++s) {
+					buffer[s].l = 0.0f;
+					buffer[s].r = 0.0f;
+				}
+			}
+		}
+
+		//read position step per output sample (32.32 fixed point), from the rate halfway through the block:
+		// (capped in input samples per output sample, since that's what limits the resampler -- see PlayingSample::set_rate)
+		float start_rate = voice.rate.value;
+		step_value_ramp(voice.rate);
+		float rate = std::min(0.5f * (start_rate + voice.rate.value) * voice.rate_scale, ResampleMaxStep);
+		uint64_t const OneStep = uint64_t(1) << 32;
+		uint64_t step = uint64_t(double(rate) * double(OneStep));
+
+		bool finished = false;
+		if (voice.stream) {
+			//mix in contiguous spans of whatever the decoding thread has produced so far:
+			Sound::Stream const &stream = *voice.stream;
+			mix_from_ring(buffer, offset, stream.buffer.data(), Sound::Stream::BufferSize, stream.written, stream.read, &pan, pan_step);
+			//n.b. if the decoder falls behind, the rest of the block is just left silent.
+
+			//(check 'finished' before 'written' so that the final samples aren't missed)
+			finished = stream.finished.load(std::memory_order_acquire) && stream.written.load(std::memory_order_acquire) == stream.read.load(std::memory_order_relaxed);
+		} else if (voice.decoder) {
+			//Opus-format sample: play the already-decoded head, then whatever the voice's decoder has produced:
+			VoiceDecoder &decoder = *voice.decoder;
+			std::vector< float > const &head = decoder.sample->opus_head;
+			uint32_t span_end = offset; //samples [0, span_end) of the block are done
+			if (voice.i < head.size()) {
+				uint32_t count = std::min(MIX_SAMPLES - span_end, uint32_t(head.size()) - voice.i);
+				mix_mono_to_stereo(&buffer[span_end].l, head.data() + voice.i, count,
+					pan.l, pan.r, pan_step.l, pan_step.r);
+				pan.l += pan_step.l * count;
+				pan.r += pan_step.r * count;
+				span_end += count;
+				voice.i += count;
+			}
+			//(voice.i stays at head.size() from here on, even when looping, since the decoder supplies the rest)
+			if (span_end < MIX_SAMPLES) {
+				mix_from_ring(buffer, span_end, decoder.buffer.data(), VoiceDecoder::BufferSize, decoder.written, decoder.read, &pan, pan_step);
+			}
+			//n.b. if the decoder falls behind, the rest of the block is just left silent.
+
+			//(check 'finished' before 'written' so that the final samples aren't missed)
+			finished = decoder.finished.load(std::memory_order_acquire) && decoder.written.load(std::memory_order_acquire) == decoder.read.load(std::memory_order_relaxed);
+		} else if (!mixed) {
+			assert(voice.i < voice.length);
+
+			//virtual voice: just advance the read position:
+			uint64_t pos = ((uint64_t(voice.i) << 32) | voice.frac) + step * (MIX_SAMPLES - offset);
+			uint64_t sample_end = uint64_t(voice.length) << 32;
+			if (pos >= sample_end) {
+				if (voice.loop) pos %= sample_end;
+				else pos = sample_end;
+			}
+			voice.i = uint32_t(pos >> 32);
+			voice.frac = uint32_t(pos);
+
+			finished = (voice.i >= voice.length);
+		} else if (step != OneStep || voice.frac != 0) {
+			assert(voice.i < voice.length);
+
+			//playing at another rate; gather the samples the resampler will read into 'window':
+			uint32_t count = MIX_SAMPLES - offset;
+			uint64_t pos = ((uint64_t(voice.i) << 32) | voice.frac);
+			uint32_t span = uint32_t((voice.frac + step * (count - 1)) >> 32) + ResampleTaps + 1;
+			assert(span <= current_block.window[group].size());
+			read_voice_samples(voice, int64_t(voice.i) - (ResampleTaps / 2 - 1), span, window);
+
+			//(window[ResampleTaps / 2 - 1] is sample voice.i)
+			resample_mono_to_stereo(&buffer[offset].l, window, count,
+				(uint64_t(ResampleTaps / 2 - 1) << 32) | voice.frac, step,
+				pan.l, pan.r, pan_step.l, pan_step.r);
+
+			pos += step * count;
+			uint64_t sample_end = uint64_t(voice.length) << 32;
+			if (pos >= sample_end) {
+				if (voice.loop) pos %= sample_end;
+				else pos = sample_end;
+			}
+			voice.i = uint32_t(pos >> 32);
+			voice.frac = uint32_t(pos);
+
+			finished = (voice.i >= voice.length);
+		} else {
+			assert(voice.i < voice.length);
+
+			//mix in contiguous spans that don't cross the end of the sample data:
+			// (Int16 data is decoded into 'decoded' a span at a time; ADPCM data a block at a time, into the voice's cache)
+			uint32_t span_end = offset;
+			while (span_end < MIX_SAMPLES) {
+				uint32_t count = std::min(MIX_SAMPLES - span_end, voice.length - voice.i);
+				float const *src;
+				if (voice.data) {
+					src = voice.data + voice.i;
+				} else if (voice.int16_data) {
+					count = std::min(count, AdpcmBlockSamples);
+					decode_int16(voice.int16_data + voice.i, count, decoded);
+					src = decoded;
+				} else {
+					uint32_t block = voice.i / AdpcmBlockSamples;
+					uint32_t block_offset = voice.i - block * AdpcmBlockSamples;
+					count = std::min(count, AdpcmBlockSamples - block_offset);
+					src = voice_adpcm_block(voice, block) + block_offset;
+				}
+				mix_mono_to_stereo(&buffer[span_end].l, src, count,
+					pan.l, pan.r, pan_step.l, pan_step.r);
+
+				//update pan values:
+				pan.l += pan_step.l * count;
+				pan.r += pan_step.r * count;
+
+				//update position in sample:
+				span_end += count;
+				voice.i += count;
+				if (voice.i == voice.length) {
+					if (voice.loop) {
+						voice.i = 0;
+						voice.adpcm_block = -1U;
+					} else {
+						break;
+					}
+				}
+			}
+
+			finished = (voice.i >= voice.length);
+		}
+
+		current_block.finished[a] = (finished || (voice.stopping && voice.volume.value == 0.0f));
+	}
+}
+
+//Mix MIX_SAMPLES samples of audio into 'buffer':
+void mix_block(LR *buffer, BlockCounts *counts) {
+	//apply any changes queued by the game thread:
+	drain_commands();
+
+	//this block covers mix_clock times [start, end):
+	current_block.start = mix_clock;
+	current_block.end = mix_clock + MIX_SAMPLES;
 
 	//zero the output buffer:
 	for (uint32_t s = 0; s < MIX_SAMPLES; ++s) {
@@ -341,98 +1507,286 @@ void mix_audio(void *, Uint8 *buffer_, int len) {
 	glm::vec3 end_position =  Sound::listener.position.value;
 	glm::vec3 end_right =  Sound::listener.right.value;
 
-	//add audio from each playing sample into the buffer:
-	for (auto si = playing_samples.begin(); si != playing_samples.end(); /* later */) {
-		Sound::PlayingSample &playing_sample = **si; //much more convenient than writing ** everywhere.
-
-		//Figure out sample panning/volume at start...
-		LR start_pan;
-		if (!(playing_sample.pan.value == playing_sample.pan.value)) {
-			//3D panning
-			compute_pan_from_listener_and_position(
-				start_position, start_right,
-				playing_sample.position.value,
-				playing_sample.half_volume_radius.value,
-				&start_pan.l, &start_pan.r);
-
-			step_position_ramp(playing_sample.position);
-			step_value_ramp(playing_sample.half_volume_radius);
-		} else {
-			//2D panning
-			compute_pan_weights(playing_sample.pan.value, &start_pan.l, &start_pan.r);
-
-			step_value_ramp(playing_sample.pan);
-		}
-		start_pan.l *= start_volume * playing_sample.volume.value;
-		start_pan.r *= start_volume * playing_sample.volume.value;
-
-		step_value_ramp(playing_sample.volume);
-
-		//..and end of the mix period:
-		LR end_pan;
-		if (!(playing_sample.pan.value == playing_sample.pan.value)) {
-			//3D panning
-			compute_pan_from_listener_and_position(
-				end_position, end_right,
-				playing_sample.position.value,
-				playing_sample.half_volume_radius.value,
-				&end_pan.l, &end_pan.r);
+	//per-active-voice gains at the start and end of this block:
+	auto &start_pans = current_block.start_pans;
+	auto &end_pans = current_block.end_pans;
+	auto &mix_voice = current_block.mix_voice;
+	// (static so that it isn't on the audio thread's stack)
+	static std::array< uint32_t, MAX_VOICES > ranking;
+
+	//figure out each voice's panning/volume over this block:
+	// 2D voices are handled right away; 3D voices are gathered (structure-of-arrays) and panned in a batch.
+	struct SpatialBatch {
+		std::array< float, MAX_VOICES > x, y, z, half_radius, volume;
+		std::array< float, MAX_VOICES > left, right;
+	};
+	static SpatialBatch start_batch, end_batch;
+	static std::array< uint32_t, MAX_VOICES > spatial; //index in active_voices of each voice in the batches
+	uint32_t spatial_count = 0;
+
+	for (uint32_t a = 0; a < active_count; ++a) {
+		Voice &voice = voices[active_voices[a]];
+		if (waiting(voice)) continue;
+
+		if (!(voice.pan.value == voice.pan.value)) {
+			//3D panning; record parameters at the start...
+			uint32_t k = spatial_count++;
+			spatial[k] = a;
+			start_batch.x[k] = voice.position.value.x;
+			start_batch.y[k] = voice.position.value.y;
+			start_batch.z[k] = voice.position.value.z;
+			start_batch.half_radius[k] = voice.half_volume_radius.value;
+			start_batch.volume[k] = start_volume * voice.volume.value;
+
+			step_position_ramp(voice.position);
+			step_value_ramp(voice.half_volume_radius);
+			step_value_ramp(voice.volume);
+
+			//..and end of the mix period:
+			end_batch.x[k] = voice.position.value.x;
+			end_batch.y[k] = voice.position.value.y;
+			end_batch.z[k] = voice.position.value.z;
+			end_batch.half_radius[k] = voice.half_volume_radius.value;
+			end_batch.volume[k] = end_volume * voice.volume.value;
 		} else {
-			//2D panning
-			compute_pan_weights(playing_sample.pan.value, &end_pan.l, &end_pan.r);
+			//2D panning; figure out sample panning/volume at start...
+			LR start_pan;
+			compute_pan_weights(voice.pan.value, &start_pan.l, &start_pan.r);
+			start_pan.l *= start_volume * voice.volume.value;
+			start_pan.r *= start_volume * voice.volume.value;
+
+			step_value_ramp(voice.pan);
+			step_value_ramp(voice.volume);
+
+			//..and end of the mix period:
+			LR end_pan;
+			compute_pan_weights(voice.pan.value, &end_pan.l, &end_pan.r);
+			end_pan.l *= end_volume * voice.volume.value;
+			end_pan.r *= end_volume * voice.volume.value;
+
+			start_pans[a] = start_pan;
+			end_pans[a] = end_pan;
 		}
+	}
 
-		end_pan.l *= end_volume * playing_sample.volume.value;
-		end_pan.r *= end_volume * playing_sample.volume.value;
-
-		//figure out a step to add at each sample so that pan will move smoothly from start to end:
-		LR pan = start_pan;
-		LR pan_step;
-		pan_step.l = (end_pan.l - start_pan.l) / MIX_SAMPLES;
-		pan_step.r = (end_pan.r - start_pan.r) / MIX_SAMPLES;
+	if (spatial_count) {
+		auto pan_batch = [spatial_count](SpatialBatch &batch, glm::vec3 const &position, glm::vec3 const &right) {
+			compute_pan_gains_3D(spatial_count,
+				batch.x.data(), batch.y.data(), batch.z.data(),
+				batch.half_radius.data(), batch.volume.data(),
+				&position.x, &right.x,
+				batch.left.data(), batch.right.data());
+		};
+		pan_batch(start_batch, start_position, start_right);
+		pan_batch(end_batch, end_position, end_right);
+		for (uint32_t k = 0; k < spatial_count; ++k) {
+			start_pans[spatial[k]] = LR{start_batch.left[k], start_batch.right[k]};
+			end_pans[spatial[k]] = LR{end_batch.left[k], end_batch.right[k]};
+		}
+	}
 
-		assert(playing_sample.i < playing_sample.data.size());
+	//decide which voices to mix:
+	// streams and Opus-format samples are always mixed (their decoders can't skip ahead);
+	// other voices are mixed if they are audible, up to real_voice_limit of them
+	// (highest priority first, then loudest); the rest are "virtual" -- they advance but aren't mixed.
+	uint32_t candidates = 0;
+	for (uint32_t a = 0; a < active_count; ++a) {
+		Voice &voice = voices[active_voices[a]];
+		mix_voice[a] = (voice.stream != nullptr || voice.decoder != nullptr);
+		if (mix_voice[a] || waiting(voice)) continue;
+		float loudness = std::max(std::max(start_pans[a].l, start_pans[a].r), std::max(end_pans[a].l, end_pans[a].r));
+		if (loudness >= audibility_threshold) ranking[candidates++] = a;
+	}
+	if (candidates > real_voice_limit) {
+		auto loudness = [](uint32_t a) {
+			return std::max(std::max(start_pans[a].l, start_pans[a].r), std::max(end_pans[a].l, end_pans[a].r));
+		};
+		std::nth_element(ranking.begin(), ranking.begin() + real_voice_limit, ranking.begin() + candidates, [&](uint32_t a, uint32_t b) {
+			float pa = voices[active_voices[a]].priority;
+			float pb = voices[active_voices[b]].priority;
+			if (pa != pb) return pa > pb;
+			return loudness(a) > loudness(b);
+		});
+		candidates = real_voice_limit;
+	}
+	for (uint32_t r = 0; r < candidates; ++r) {
+		mix_voice[ranking[r]] = 1;
+	}
 
-		for (uint32_t i = 0; i < MIX_SAMPLES; ++i) {
-			//mix one sample based on current pan values:
-			buffer[i].l += pan.l * playing_sample.data[playing_sample.i];
-			buffer[i].r += pan.r * playing_sample.data[playing_sample.i];
+	//add audio from each playing sample into its bus's buffer:
+	// (on the MixPool threads, if there are enough voices to be worth splitting up)
+	current_block.groups = 1;
+	if (mix_pool) {
+		current_block.groups = std::max(1U, std::min(active_count / MIN_VOICES_PER_GROUP, uint32_t(mix_pool->threads.size()) + 1));
+	}
+	for (uint32_t g = 0; g < current_block.groups; ++g) {
+		current_block.used[g].fill(0);
+	}
+	if (current_block.groups > 1) {
+		mix_pool->run(current_block.groups);
+	} else {
+		mix_group(0);
+	}
 
-			//update position in sample:
-			playing_sample.i += 1;
-			if (playing_sample.i == playing_sample.data.size()) {
-				if (playing_sample.loop) {
-					playing_sample.i = 0;
-				} else {
-					break;
-				}
+	//run each bus with something in it through its effects, then add it to the output:
+	// (buses that no group mixed into this block are skipped entirely)
+	for (uint32_t b = 0; b < Sound::BusCount; ++b) {
+		BusState &bus = buses[b];
+		float start_gain = bus.volume.value;
+		step_value_ramp(bus.volume);
+		float end_gain = bus.volume.value;
+
+		//sum the groups' buffers into the first one:
+		LR *bus_buffer = nullptr;
+		for (uint32_t g = 0; g < current_block.groups; ++g) {
+			if (!current_block.used[g][b]) continue;
+			LR const *group_buffer = current_block.buffers[g][b].data();
+			if (!bus_buffer) {
+				bus_buffer = current_block.buffers[g][b].data();
+				continue;
 			}
+			for (uint32_t s = 0; s < MIX_SAMPLES; ++s) {
+				bus_buffer[s].l += group_buffer[s].l;
+				bus_buffer[s].r += group_buffer[s].r;
+			}
+		}
+		if (!bus_buffer) continue;
 
-			//update pan values:
-			pan.l += pan_step.l;
-			pan.r += pan_step.r;
+		for (uint32_t e = 0; e < bus.effect_count; ++e) {
+			bus.effects[e]->process(&bus_buffer[0].l, MIX_SAMPLES);
 		}
 
-		if (playing_sample.i >= playing_sample.data.size()
-		 || (playing_sample.stopping && playing_sample.volume.value == 0.0f)) { //sample has finished
-		 	playing_sample.stopped = true;
-			//erase from list:
-			auto old = si;
-			++si;
-			playing_samples.erase(old);
+		//bus volume ramps smoothly over the block:
+		float gain = start_gain;
+		float gain_step = (end_gain - start_gain) / MIX_SAMPLES;
+		for (uint32_t s = 0; s < MIX_SAMPLES; ++s) {
+			buffer[s].l += gain * bus_buffer[s].l;
+			buffer[s].r += gain * bus_buffer[s].r;
+			gain += gain_step;
+		}
+	}
+
+	//remove voices that have finished:
+	uint32_t kept = 0; //voices [0,kept) of active_voices are still playing after this block
+	uint32_t real_count = 0; //number of voices mixed
+	for (uint32_t a = 0; a < active_count; ++a) {
+		if (current_block.mixed[a]) real_count += 1;
+		if (current_block.finished[a]) { //sample has finished
+			//hand any decoder back to the decoder thread to close:
+			if (VoiceDecoder *decoder = voices[active_voices[a]].decoder) {
+				decoder->state.store(VoiceDecoder::Releasing, std::memory_order_release);
+			}
+			//n.b. after this the game thread may reuse the voice, so don't touch it again:
+			finish_voice(active_voices[a]);
 		} else {
-			++si;
+			active_voices[kept] = active_voices[a];
+			kept += 1;
 		}
 	}
+	mix_clock = current_block.end;
+	audio_clock.store(mix_clock, std::memory_order_release);
+
+	counts->playing = active_count;
+	counts->mixed = real_count;
+	counts->finished = active_count - kept;
+
+	active_count = kept;
 
 	/*//DEBUG: report output power:
 	float max_power = 0.0f;
 	for (uint32_t s = 0; s < MIX_SAMPLES; ++s) {
 		max_power = std::max(max_power, (buffer[s].l * buffer[s].l + buffer[s].r * buffer[s].r));
 	}
-	std::cout << "Max Power: " << std::sqrt(max_power) << "; playing samples: " << playing_samples.size() << std::endl; //DEBUG
+	std::cout << "Max Power: " << std::sqrt(max_power) << "; playing samples: " << active_count << std::endl; //DEBUG
 	*/
+}
+
+//Mix 'blocks' MIX_SAMPLES-sized blocks of audio into 'buffer' and record instrumentation:
+// (called by the audio callback, or by the pre-mix thread when pre-mixing)
+void mix_chunk(LR *buffer, uint32_t blocks) {
+	auto start = std::chrono::steady_clock::now();
+	uint64_t const chunk_ns = uint64_t(blocks) * MIX_SAMPLES * 1000000000ULL / AUDIO_RATE;
+
+	BlockCounts counts;
+	uint32_t peak = 0;
+	uint32_t finished = 0;
+	for (uint32_t b = 0; b < blocks; ++b) {
+		mix_block(buffer + b * MIX_SAMPLES, &counts);
+		peak = std::max(peak, counts.playing);
+		finished += counts.finished;
+	}
+
+	//record instrumentation:
+	// (voice counts include voices that finished during the last block)
+	mix_counters.active_voices.store(counts.playing, std::memory_order_relaxed);
+	mix_counters.real_voices.store(counts.mixed, std::memory_order_relaxed);
+	if (peak > mix_counters.peak_voices.load(std::memory_order_relaxed)) {
+		mix_counters.peak_voices.store(peak, std::memory_order_relaxed);
+	}
+	bump(mix_counters.voices_removed, finished);
+
+	uint64_t mix_ns = uint64_t(std::chrono::duration_cast< std::chrono::nanoseconds >(std::chrono::steady_clock::now() - start).count());
+	uint32_t bucket = std::min< uint32_t >(Sound::MixStats::HistogramBuckets - 1, uint32_t(mix_ns * 10 / chunk_ns));
+	bump(mix_counters.histogram[bucket]);
+	mix_counters.last_mix_ns.store(uint32_t(mix_ns), std::memory_order_relaxed);
+	if (mix_ns > mix_counters.peak_mix_ns.load(std::memory_order_relaxed)) {
+		mix_counters.peak_mix_ns.store(uint32_t(mix_ns), std::memory_order_relaxed);
+	}
+	mix_counters.total_mix_ns.store(mix_counters.total_mix_ns.load(std::memory_order_relaxed) + mix_ns, std::memory_order_relaxed);
+	//(callbacks is stored last so that readers see a count that matches the other counters)
+	mix_counters.callbacks.store(mix_counters.callbacks.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+//The callback registered with the audio device:
+// (lateness is only measured here, since mix_offline calls mix_audio with no device -- and so no deadline)
+void audio_callback(void *userdata, Uint8 *buffer, int len) {
+	//for instrumentation: how long since the last callback? (callbacks should come once per buffer)
+	std::chrono::nanoseconds const BlockTime = std::chrono::nanoseconds(uint64_t(callback_samples) * 1000000000ULL / AUDIO_RATE);
+	auto start = std::chrono::steady_clock::now();
+	if (have_previous_callback && start - previous_callback > BlockTime + BlockTime / 2) {
+		bump(mix_counters.late_callbacks);
+	}
+	previous_callback = start;
+	have_previous_callback = true;
+
+	mix_audio(userdata, buffer, len);
+}
+
+//The audio callback -- invoked (via audio_callback) by SDL when it needs more sound to play, or by mix_offline:
+// mixes in MIX_SAMPLES-sized blocks, so ramps and panning behave the same for any callback size.
+void mix_audio(void *, Uint8 *buffer_, int len) {
+	assert(buffer_); //should always have some audio buffer
+
+	assert(len >= 0 && uint32_t(len) % (MIX_SAMPLES * sizeof(LR)) == 0); //should always have a whole number of blocks
+	LR *buffer = reinterpret_cast< LR * >(buffer_);
+	uint32_t count = uint32_t(len) / sizeof(LR);
+
+	if (premix) {
+		//just copy out whatever the pre-mix thread has ready:
+		uint32_t const size = uint32_t(premix->ring.size());
+		uint32_t read = premix->read.load(std::memory_order_relaxed);
+		uint32_t available = premix->written.load(std::memory_order_acquire) - read;
+		uint32_t copied = 0;
+		while (copied < count && available > 0) {
+			uint32_t offset = read & (size - 1);
+			uint32_t span = std::min(std::min(count - copied, available), size - offset);
+			std::copy(premix->ring.data() + offset, premix->ring.data() + offset + span, buffer + copied);
+			copied += span;
+			read += span;
+			available -= span;
+		}
+		premix->read.store(read, std::memory_order_release);
+		//(no notify: the pre-mix thread notices the free space on its next poll)
+
+		if (copied < count) {
+			//pre-mix thread fell behind; play silence rather than wait:
+			std::fill(buffer + copied, buffer + count, LR{0.0f, 0.0f});
+			bump(mix_counters.underruns);
+		}
+		return;
+	}
 
+	mix_chunk(buffer, count / MIX_SAMPLES);
 }
 
 
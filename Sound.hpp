@@ -2,10 +2,17 @@
 
 #include <glm/glm.hpp>
 
+#include <atomic>
 #include <memory>
+#include <thread>
 #include <vector>
 #include <string>
 #include <cmath>
+#include <cstddef>
+#include <limits>
+
+struct OpusReader; //from load_opus.hpp
+struct MappedFile; //from MappedFile.hpp
 
 //Game audio system. Simplified from f18-base3.
 //Uses 48kHz sampling rate.
@@ -14,15 +21,91 @@ namespace Sound {
 
 //Sample objects hold mono (one-channel) audio.
 struct Sample {
+	//How sample data is kept in memory:
+	// (compact formats are decoded by the mixer as it plays; see sample_codec.hpp)
+	enum class Format : uint8_t {
+		Float, //32-bit float
+		Int16, //16-bit integer (1/2 the memory of Float)
+		ADPCM, //IMA-ADPCM (about 1/8 the memory of Float; some loss of quality)
+		Opus, //the '.opus' file itself (typically 1/10 the memory of Float or less), decoded separately for each playing voice
+	};
+	// n.b. Opus-format samples can only be loaded from '.opus' files; each voice playing one gets its own decoder,
+	//  run ahead of the mixer on a background thread (at most 32 such voices at once). Like streams, they are always mixed
+	//  and ignore set_rate; since their first fraction of a second is kept decoded, they still start playing right away.
+
 	//Load from a '.wav' or '.opus' file.
-	//  will warn and convert if sound is not already 48kHz mono:
-	Sample(std::string const &filename);
+	//  will warn and convert if sound is not already mono; '.wav' files keep their own sampling rate:
+	Sample(std::string const &filename, Format format = Format::Float);
 	
-	//Directly supply an audio buffer:
-	Sample(std::vector< float > const &data);
+	//Directly supply an audio buffer (at 'rate' samples per second):
+	Sample(std::vector< float > const &data, Format format = Format::Float, uint32_t rate = 48000);
+
+	~Sample();
+
+	Format format = Format::Float;
 
-	//sample data is stored as 48kHz, mono, floating-point:
+	//sampling rate of the data; the mixer resamples anything other than 48kHz as it plays:
+	uint32_t rate = 48000;
+
+	//Float-format sample data is stored as mono, floating-point:
 	std::vector< float > data;
+
+	//..except for '.opus' files with an entry in the decoded-audio cache (see pcm_cache.hpp),
+	// whose samples are read directly from the memory-mapped cache entry (and 'data' is empty):
+	std::unique_ptr< MappedFile > mapped;
+	float const *mapped_samples = nullptr;
+	size_t mapped_count = 0;
+
+	//Int16-format and ADPCM-format sample data:
+	std::vector< int16_t > int16_data;
+	std::vector< uint8_t > adpcm_data; //blocks of AdpcmBlockSamples samples
+	size_t adpcm_count = 0;
+
+	//Opus-format sample data:
+	std::vector< uint8_t > opus_data; //contents of the '.opus' file
+	std::vector< float > opus_head; //its first few thousand samples, already decoded
+	size_t opus_count = 0;
+
+	//the samples (of a Float-format sample), wherever they are stored:
+	float const *samples() const { return mapped ? mapped_samples : data.data(); }
+
+	//number of samples (in any format):
+	size_t size() const;
+
+	//bytes of sample data held in memory (or mapped):
+	size_t memory_size() const;
+
+	Sample(Sample const &) = delete;
+
+	//internals:
+	void set_format(Format format); //re-encode Float data into the given format
+};
+
+//Stream objects decode a long audio file a bit at a time, on a background thread, while it plays
+// (memory use doesn't depend on the length of the file, so this is a good fit for music):
+struct Stream {
+	//Open a '.opus' file and start decoding its beginning; throws on error:
+	Stream(std::string const &filename);
+	~Stream();
+
+	//internals:
+	//NOTE: a stream can only feed one playing sample at a time, and playback picks up
+	// wherever the decoder happens to be (so play each stream once, and keep it around while it plays).
+
+	//decoded samples are handed from the decoding thread to the mixer through this ring buffer:
+	static constexpr uint32_t BufferSize = 1 << 17; //(about 2.7 seconds of audio; n.b. must be a power of two)
+	std::vector< float > buffer;
+	std::atomic< uint32_t > written{0}; //count of samples decoded (only stored by the decoding thread)
+	mutable std::atomic< uint32_t > read{0}; //count of samples mixed (only stored by the mixer)
+
+	mutable std::atomic< bool > loop{false}; //should decoding wrap around to the start of the file?
+	std::atomic< bool > finished{false}; //has decoding reached the end of the file (and not looped)?
+	std::atomic< bool > quit{false}; //set to stop the decoding thread
+
+	std::unique_ptr< OpusReader > reader;
+	std::thread thread;
+
+	Stream(Stream const &) = delete;
 };
 
 //Ramp<> manages values that should be smoothly interpolated
@@ -48,79 +131,161 @@ struct Ramp {
 	float ramp = 0.0f;
 };
 
-// 'PlayingSample' objects book-keep samples that are currently playing:
+// 'PlayingSample' objects are handles to samples that are currently playing.
+// They are small and cheap to copy, and stand in for the std::shared_ptr< PlayingSample >
+// that older code kept -- 'handle->stop()', 'handle == nullptr', and 'handle = nullptr' all still work.
+// (The voice data itself lives in a fixed-size pool inside Sound.cpp; handles carry a generation
+//  number so that a handle to a finished voice never affects whatever voice reuses its slot.)
 struct PlayingSample {
-	//change the panning or volume of a playing sample (and do proper locking);
+	//change the panning or volume of a playing sample (sends a command to the mixer; never blocks);
 	// value will change over 'ramp' seconds to avoid creating audible artifacts:
-	void set_volume(float new_volume, float ramp = 1.0f / 60.0f);
+	void set_volume(float new_volume, float ramp = 1.0f / 60.0f) const;
 	//set the panning of a sample (use only on samples in "2D" mode; no effect on "3D" samples):
-	void set_pan(float new_pan, float ramp = 1.0f / 60.0f);
+	void set_pan(float new_pan, float ramp = 1.0f / 60.0f) const;
 	//set the position of a sample (use only on samples in "3D" mode; no effect on "2D" samples):
-	void set_position(glm::vec3 const &new_position, float ramp = 1.0f / 60.0f);
+	void set_position(glm::vec3 const &new_position, float ramp = 1.0f / 60.0f) const;
 	//set the half-volume radius (use only on "3D" playing sounds):
-	void set_half_volume_radius(float new_radius, float ramp = 1.0f / 60.0f);
+	void set_half_volume_radius(float new_radius, float ramp = 1.0f / 60.0f) const;
+
+	//set the playback rate of a sample (1.0 == normal; 2.0 == twice as fast and an octave higher):
+	// the sample is read at most 4x as fast as the output rate (48kHz) -- i.e., rate * (sample rate / 48kHz) is capped at 4,
+	// so, e.g., a 96kHz sample can't play faster than set_rate(2.0).
+	// (no effect on streams or Opus-format samples)
+	void set_rate(float new_rate, float ramp = 1.0f / 60.0f) const;
+
+	//set the priority of a sample (default 0): when more samples are audible than the voice limit,
+	// higher-priority samples are mixed first (see Sound::set_voice_limit):
+	void set_priority(float priority) const;
 
 	//'stop' will fade sample out over 'ramp' seconds and then remove it from the active samples:
-	void stop(float ramp = 1.0f / 60.0f);
+	void stop(float ramp = 1.0f / 60.0f) const;
+
+	//was playback stopped (either by running out of sample, or by stop())?
+	// (also true for null handles)
+	bool stopped() const;
+
+	//pointer-like syntax, for code written against shared_ptr< PlayingSample >:
+	PlayingSample const *operator->() const { return this; }
+	explicit operator bool() const { return index != -1U; }
+	bool operator==(std::nullptr_t) const { return index == -1U; }
+	bool operator!=(std::nullptr_t) const { return index != -1U; }
+
+	PlayingSample() = default;
+	PlayingSample(std::nullptr_t) { }
 
 	//internals:
-	//NOTE: PlayingSample is used in a separate thread; so setting these values directly
-	// may result in bad results. Instead, use the functions above, which perform locking!
-	std::vector< float > const &data; //reference to sample data being played
-	uint32_t i = 0; //next data value to read
-	bool loop = false; //should playback loop after data runs out?
-	bool stopping = false; //is playing stopping?
-	bool stopped = false; //was playback stopped (either by running out of sample, or by stop())?
-
-	Ramp< float > volume = Ramp< float >(1.0f);
-
-	//2D playback panning control: ('NaN' if sound played in 3D mode)
-	Ramp< float > pan = Ramp< float >(std::numeric_limits< float >::quiet_NaN());
-
-	//3D playback panning control: ('NaN' if sound played in 2D mode)
-	Ramp< glm::vec3 > position = Ramp< glm::vec3 >(std::numeric_limits< float >::quiet_NaN());
-	Ramp< float > half_volume_radius = std::numeric_limits< float >::quiet_NaN();
-
-	PlayingSample(Sample const &sample_, float volume_, float pan_, bool loop_)
-		: data(sample_.data), loop(loop_), volume(volume_), pan(pan_) { }
-	PlayingSample(Sample const &sample_, float volume_, glm::vec3 const &position_, float half_volume_radius_, bool loop_)
-		: data(sample_.data), loop(loop_), volume(volume_), position(position_), half_volume_radius(half_volume_radius_) { }
+	uint32_t index = -1U; //slot in the voice pool (-1U for null handles)
+	uint32_t generation = 0; //generation of that slot when this voice was started
 };
 
 // ------- global functions -------
 
-void init(); //call Sound::init() from main.cpp before using any member functions
+//Output buffer size, in samples at 48kHz; smaller buffers respond faster but cost more CPU time
+// (callback overhead) and are more likely to underrun on a busy machine:
+enum class Latency : uint32_t {
+	Frames128 = 128, //~2.7ms
+	Frames256 = 256, //~5.3ms
+	Frames512 = 512, //~10.7ms
+	Frames1024 = 1024, //~21.3ms
+};
+// n.b. the mixer always works in 128-sample blocks internally, so ramps and panning sound the same at every latency.
+
+//call Sound::init() from main.cpp before using any member functions:
+// if 'mix_workers' is non-zero, mixing moves off the audio callback to a pre-mix thread that keeps up to
+// two buffers ready ahead of it (so sound changes take effect up to two buffers later), and blocks with
+// many voices are split into groups mixed in parallel by the pre-mix thread and 'mix_workers' more threads (at most 7).
+// (for scenes with hundreds of voices; with only a few voices, the extra latency isn't worth it)
+void init(Latency latency = Latency::Frames1024, uint32_t mix_workers = 0);
 
 void shutdown(); //call Sound::shutdown() from main.cpp to gracefully(-ish) exit
 
+//Buses group voices so they can be controlled -- and processed by effects -- together:
+// every voice plays on one bus (chosen when it starts); each bus is run through its effects,
+// scaled by its volume, and added to the output. Buses without any (mixed) voices are skipped.
+enum class Bus : uint8_t {
+	SFX, //default
+	Music,
+	Dialogue,
+};
+constexpr uint32_t const BusCount = 3;
+
+//Effects process a bus's audio in blocks, on the mixer thread:
+struct Effect {
+	virtual ~Effect() = default;
+	//process 'count' stereo samples (interleaved LRLR...) in place;
+	// called once per 128-sample mixer block, and only for blocks in which the bus has voices:
+	virtual void process(float *stereo, uint32_t count) = 0;
+};
+
 //Call 'Sound::play' to play a sample once.
 //  if you hang on to the return value, you can change the panning, volume, or stop playback early.
-std::shared_ptr< PlayingSample > play(
+//  (if all voices are busy, returns a null handle and the sample does not play)
+PlayingSample play(
 	Sample const &sample,
 	float volume = 1.0f,
-	float pan = 0.0f //-1.0f == hard left, 1.0f == hard right
+	float pan = 0.0f, //-1.0f == hard left, 1.0f == hard right
+	Bus bus = Bus::SFX
 );
 //The play_3D version will play a sample in '3D' mode (that is, panning determined by listener position):
-std::shared_ptr< PlayingSample > play_3D(
+PlayingSample play_3D(
 	Sample const &sample,
 	float volume,
 	glm::vec3 const &position,
-	float half_volume_radius = std::numeric_limits< float >::infinity()
+	float half_volume_radius = std::numeric_limits< float >::infinity(),
+	Bus bus = Bus::SFX
+);
+
+//Sample-accurate scheduling:
+// 'audio_time' is the mixer's clock: seconds of audio mixed so far. It advances one output buffer at a time
+// (see Latency), so schedule sounds at least block_samples() / 48000 seconds after audio_time() to hit them exactly.
+double audio_time();
+//play_at and play_3D_at start playing 'sample' at exactly 'time' on the audio_time clock, even partway through a buffer:
+//  (times that have already passed play as soon as possible)
+PlayingSample play_at(
+	Sample const &sample,
+	double time,
+	float volume = 1.0f,
+	float pan = 0.0f, //-1.0f == hard left, 1.0f == hard right
+	Bus bus = Bus::SFX
+);
+PlayingSample play_3D_at(
+	Sample const &sample,
+	double time,
+	float volume,
+	glm::vec3 const &position,
+	float half_volume_radius = std::numeric_limits< float >::infinity(),
+	Bus bus = Bus::SFX
 );
 
 //Call 'Sound::loop' to play a sample ~forever~.
 //  if you hang on to the return value, you can change the panning, volume, or stop playback.
-std::shared_ptr< PlayingSample > loop(
+PlayingSample loop(
 	Sample const &sample,
 	float volume = 1.0f,
-	float pan = 0.0f //-1.0f == hard left, 1.0f == hard right
+	float pan = 0.0f, //-1.0f == hard left, 1.0f == hard right
+	Bus bus = Bus::SFX
 );
 //The loop_3D version will loop a sample in '3D' mode (that is, panning determined by listener position):
-std::shared_ptr< PlayingSample > loop_3D(
+PlayingSample loop_3D(
 	Sample const &sample,
 	float volume,
 	glm::vec3 const &position,
-	float half_volume_radius = std::numeric_limits< float >::infinity()
+	float half_volume_radius = std::numeric_limits< float >::infinity(),
+	Bus bus = Bus::SFX
+);
+
+//Call 'Sound::play_stream' to play a stream once, or 'Sound::loop_stream' to loop it (seamlessly) ~forever~:
+PlayingSample play_stream(
+	Stream const &stream,
+	float volume = 1.0f,
+	float pan = 0.0f, //-1.0f == hard left, 1.0f == hard right
+	Bus bus = Bus::SFX
+);
+PlayingSample loop_stream(
+	Stream const &stream,
+	float volume = 1.0f,
+	float pan = 0.0f, //-1.0f == hard left, 1.0f == hard right
+	Bus bus = Bus::SFX
 );
 
 //Listener controls the panning of "3D" samples (ones played using the "position" version of the play functions):
@@ -136,13 +301,76 @@ extern struct Listener listener;
 //"panic button" to shut off all currently playing sounds:
 void stop_all_samples();
 
+//limit the cost of mixing:
+// at most 'max_real_voices' samples are mixed at once -- the highest priority, then loudest -- and samples
+// whose volume (after panning and distance) is below 'audibility_threshold' aren't mixed at all.
+// Samples that aren't mixed are "virtual": they keep their place (and keep looping, or finish on time)
+// and fade back in if they become audible again. Streams (and Opus-format samples) are always mixed and don't count toward the limit.
+// (defaults: 64 voices, 1e-3 threshold)
+void set_voice_limit(uint32_t max_real_voices, float audibility_threshold = 1.0e-3f);
+
+//set a bus's volume (default 1.0):
+void set_bus_volume(Bus bus, float new_volume, float ramp = 1.0f / 60.0f);
+
+//add an effect to the end of a bus's effect chain (at most 4 per bus), or remove all of a bus's effects:
+// the mixer calls the effect from its own thread, so keep it alive (and don't change it) until Sound::shutdown().
+void add_bus_effect(Bus bus, Effect *effect);
+void clear_bus_effects(Bus bus);
+
 //set global volume:
 void set_volume(float new_volume, float ramp = 1.0f / 60.0f);
 extern Ramp< float > volume;
 
+//Mixer instrumentation:
+// counters kept by the audio callback; reading them never blocks the callback (or waits for it).
+struct MixStats {
+	//callbacks by mix time as a fraction of the time available (one block of audio):
+	// buckets are [0%,10%), [10%,20%), ..., [90%,100%), and 100%+ (the deadline was missed)
+	static constexpr uint32_t HistogramBuckets = 11;
+	uint32_t histogram[HistogramBuckets] = { 0 };
+
+	uint32_t callbacks = 0; //number of callbacks
+	float last_budget_used = 0.0f; //fraction of the block's time taken by the last callback
+	float peak_budget_used = 0.0f; //..by the slowest callback
+	float average_budget_used = 0.0f; //..on average
+
+	uint32_t active_voices = 0; //voices playing as of the last callback
+	uint32_t real_voices = 0; //..of which were mixed (rather than virtual)
+	uint32_t peak_voices = 0; //most voices playing at once
+
+	uint32_t voices_added = 0; //voices started
+	uint32_t voices_removed = 0; //voices finished
+
+	uint32_t late_callbacks = 0; //callbacks that came more than half a block later than expected (likely audible dropouts; only counted with an audio device open)
+	uint32_t underruns = 0; //callbacks that found the pre-mix thread behind (and so played some silence)
+	// n.b. when pre-mixing (see Sound::init), 'callbacks', the histogram, and the budgets time the pre-mix thread's work per buffer.
+};
+//(counts are since the audio system started, or the last reset_mix_stats)
+MixStats get_mix_stats();
+void reset_mix_stats(); //(takes effect at the next callback)
+
+//Offline mixing, for tests and benchmarks on machines without an audio device:
+// runs the same mixer as the audio callback, 'blocks' times in a row, as fast as possible,
+// appending the interleaved stereo output to *out (if not null).
+// Only allowed when no audio device is open (i.e., Sound::init() wasn't called, or couldn't open a device).
+// The output is determined by the sequence of calls made (except for Streams, which decode on their own thread).
+// (use save_wav from load_wav.hpp to write the output to a file)
+void mix_offline(uint32_t blocks, std::vector< float > *out = nullptr);
+
+//number of (stereo) samples produced per mixed block (i.e., per audio callback):
+uint32_t block_samples();
+
+//set the block size used by mix_offline (which otherwise uses the Sound::init latency, default Frames1024):
+// only allowed when no audio device is open.
+void set_offline_latency(Latency latency);
+
+//use 'mix_workers' threads to help mix_offline mix blocks with many voices (as in Sound::init; 0 to stop):
+// only allowed when no audio device is open. (output differs slightly from single-threaded mixing, since voices are summed in groups)
+void set_offline_mix_workers(uint32_t mix_workers);
+
 //the audio callback doesn't run between Sound::lock() and Sound::unlock()
-// the set_*/stop/play/... functions already use these helpers, so you shouldn't need
-// to call them unless your code is modifying values directly:
+// the set_*/stop/play/... functions send commands through a lock-free queue instead,
+// so you shouldn't need to call these unless your code is modifying values directly:
 void lock();
 void unlock();
 
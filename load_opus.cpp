@@ -1,5 +1,7 @@
 #include "load_opus.hpp"
 
+#include "mix_kernels.hpp"
+
 #include <opusfile.h>
 
 #include <cassert>
@@ -7,48 +9,287 @@
 #include <cmath>
 #include <stdexcept>
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <exception>
+
+namespace {
+	using OpusFilePtr = std::unique_ptr< OggOpusFile, decltype(&op_free) >;
+
+	OpusFilePtr open_opus(std::string const &filename) {
+		int err = 0;
+		OpusFilePtr op(op_open_file(filename.c_str(), &err), op_free);
+		if (err != 0 || !op) {
+			throw std::runtime_error("opusfile error " + std::to_string(err) + " opening \"" + filename + "\".");
+		}
+		return op;
+	}
+
+	//decode up to 'count' samples of mono into 'dst'; returns the number decoded (less than 'count' only at end of file):
+	// (mono files are read straight into 'dst'; everything else is read as stereo into 'pcm' and downmixed)
+	size_t decode(OggOpusFile *op, bool mono, float *dst, size_t count, std::vector< float > &pcm, std::string const &filename) {
+		size_t decoded = 0;
+		while (decoded < count) {
+			int ret;
+			if (mono) {
+				int want = int(std::min< size_t >(count - decoded, std::numeric_limits< int >::max()));
+				ret = op_read_float(op, dst + decoded, want, nullptr);
+			} else {
+				if (pcm.empty()) pcm.resize(2*5760); //120ms (the longest opus frame) of stereo
+				int want = int(std::min< size_t >(count - decoded, pcm.size() / 2));
+				ret = op_read_float_stereo(op, pcm.data(), 2 * want);
+			}
+			if (ret < 0) {
+				throw std::runtime_error("opusfile read error " + std::to_string(ret) + " reading \"" + filename + "\".");
+			}
+			if (ret == 0) break; //end of file
+			//positive return values are the number of samples read per channel:
+			if (!mono) downmix_stereo_to_mono(dst + decoded, pcm.data(), uint32_t(ret));
+			decoded += size_t(ret);
+		}
+		return decoded;
+	}
+
+	//files at least this long are decoded in parallel segments (when more than one thread is allowed):
+	constexpr size_t ParallelMinSamples = 60 * 48000;
+	//...of at least this length:
+	constexpr size_t SegmentMinSamples = 15 * 48000;
+	//each segment starts decoding this far before its start (on top of opusfile's own 80ms seek pre-roll):
+	constexpr size_t SegmentPreroll = 9600;
+	//and decodes this far past its end, to check against the next segment:
+	constexpr size_t SegmentCheck = 4800;
+
+	//threads currently decoding in load_opus, across all callers (e.g., several Load<> workers at once):
+	// segment threads are only started while this is below the core count, so the machine isn't oversubscribed.
+	std::atomic< uint32_t > decoding_threads(0);
+
+	//totals for get_opus_load_stats:
+	std::atomic< uint32_t > parallel_loads(0);
+	std::atomic< uint32_t > parallel_segments(0);
+	std::atomic< uint32_t > redecoded_segments(0);
+
+	//helper: count threads in decoding_threads for as long as it exists:
+	struct DecodingThreads {
+		explicit DecodingThreads(uint32_t count_) : count(count_) { decoding_threads += count; }
+		~DecodingThreads() { decoding_threads -= count; }
+		//claim up to 'wanted' more threads (as many as there are idle cores); returns the number claimed:
+		uint32_t claim(uint32_t wanted) {
+			uint32_t cores = std::max(1U, std::thread::hardware_concurrency());
+			uint32_t in_use = decoding_threads.load();
+			uint32_t extra;
+			do {
+				extra = std::min(wanted, cores > in_use ? cores - in_use : 0U);
+			} while (extra && !decoding_threads.compare_exchange_weak(in_use, in_use + extra));
+			count += extra;
+			return extra;
+		}
+		uint32_t count;
+	};
+}
 
-void load_opus(std::string const &filename, std::vector< float > *data_) {
+void load_opus(std::string const &filename, std::vector< float > *data_, uint32_t threads) {
 	assert(data_);
 	auto &data = *data_;
 	data.clear();
 
-	std::cout << "loading '" << filename << "'..."; std::cout.flush();
+	auto before = std::chrono::steady_clock::now();
 
-	//will hold opusfile * int a std::unique_ptr so that it will automatically be deleted:
-	int err = 0;
-	std::unique_ptr< OggOpusFile, decltype(&op_free) > op(
-		op_open_file(filename.c_str(), &err), //pointer to hold
-		op_free //deletion function
-	);
-	if (err != 0) {
-		throw std::runtime_error("opusfile error " + std::to_string(err) + " opening \"" + filename + "\".");
-	}
+	DecodingThreads budget(1); //(this thread)
+
+	OpusFilePtr op = open_opus(filename);
 
-	//get length in samples:
+	//get length in samples, and allocate all of it up front:
 	ogg_int64_t length = op_pcm_total(op.get(), -1);
 	if (length >= 0) {
-		data.reserve(length);
+		data.resize(size_t(length));
 	} else {
 		std::cerr << "WARNING: cannot estimate length of '" << filename << "', loading may be slow." << std::endl;
-		length = 0;
-		data.reserve(2*48000);
-	}
-
-	std::vector< float > pcm(2*48000*2, 0.0f); //seems like reads are generally 960 samples so this is definitely overkill
-	for (;;) {
-		int ret = op_read_float_stereo(op.get(), pcm.data(), int(pcm.size()));
-		if (ret >= 0) {
-			//positive return values are the number of samples read per channel; copy into data:
-			data.reserve(data.size() + ret);
-			for (uint32_t i = 0; i < uint32_t(ret); ++i) {
-				data.emplace_back((pcm[2*i] + pcm[2*i+1]) * 0.5f); //downmix to mono by averaging
+		data.resize(2*48000);
+	}
+
+	//mono files (with only one link, so the channel count can't change partway) are decoded straight into 'data':
+	bool mono = (op_link_count(op.get()) == 1 && op_head(op.get(), 0)->channel_count == 1);
+
+	//long files are split into segments decoded in parallel:
+	uint32_t segments = 1;
+	if (length >= 0 && size_t(length) >= ParallelMinSamples) {
+		if (threads == 0) threads = std::max(1U, std::thread::hardware_concurrency());
+		segments = uint32_t(std::min< size_t >(threads, size_t(length) / SegmentMinSamples));
+		segments = std::max(1U, segments);
+		//(fewer, if other loads are already keeping the cores busy)
+		segments = 1 + budget.claim(segments - 1);
+	}
+
+	size_t decoded = 0;
+	uint32_t redecoded = 0;
+	if (segments == 1) {
+		std::vector< float > pcm;
+		for (;;) {
+			decoded += decode(op.get(), mono, data.data() + decoded, data.size() - decoded, pcm, filename);
+			if (decoded < data.size()) break; //reached end of file
+			//(only happens if the length was unknown or wrong)
+			data.resize(std::max(data.size() * 2, decoded + 5760));
+		}
+		data.resize(decoded);
+	} else {
+		//Each segment is decoded by its own OggOpusFile, seeked to just before the segment's start.
+		// Opus decoders carry state from packet to packet, so the first samples after a seek can differ
+		// (slightly) from what a decoder that started at the beginning of the file would produce.
+		// So each segment also decodes a little past its end; if that doesn't exactly match the start of the next segment,
+		// the next segment is thrown away and decoded by continuing the previous segment's decoder instead.
+		// (A matching check is taken to mean the decoders have converged, so the result is only as exact as that assumption;
+		//  mix-bench compares against a serial decode, and get_opus_load_stats counts how often re-decoding happens.)
+		std::vector< size_t > bounds(segments + 1);
+		for (uint32_t k = 0; k <= segments; ++k) {
+			bounds[k] = size_t(length) * k / segments;
+		}
+
+		struct Segment {
+			OpusFilePtr op = OpusFilePtr(nullptr, op_free);
+			size_t decoded = 0; //samples of [bounds[k], bounds[k+1]) decoded
+			std::vector< float > check; //samples past bounds[k+1]
+			std::vector< float > pcm; //stereo decode buffer
+			std::exception_ptr error;
+		};
+		std::vector< Segment > segs(segments);
+		segs[0].op = std::move(op);
+
+		auto decode_segment = [&](uint32_t k) {
+			Segment &seg = segs[k];
+			try {
+				if (k > 0) {
+					seg.op = open_opus(filename);
+					size_t start = bounds[k] - std::min(bounds[k], SegmentPreroll);
+					int ret = op_pcm_seek(seg.op.get(), start);
+					if (ret != 0) {
+						throw std::runtime_error("opusfile seek error " + std::to_string(ret) + " reading \"" + filename + "\".");
+					}
+					std::vector< float > preroll(bounds[k] - start);
+					decode(seg.op.get(), mono, preroll.data(), preroll.size(), seg.pcm, filename);
+				}
+				seg.decoded = decode(seg.op.get(), mono, data.data() + bounds[k], bounds[k+1] - bounds[k], seg.pcm, filename);
+				if (k + 1 < segments) {
+					seg.check.resize(std::min(SegmentCheck, size_t(length) - bounds[k+1]));
+					seg.check.resize(decode(seg.op.get(), mono, seg.check.data(), seg.check.size(), seg.pcm, filename));
+				}
+			} catch (...) {
+				seg.error = std::current_exception();
+			}
+		};
+
+		std::vector< std::thread > workers;
+		for (uint32_t k = 1; k < segments; ++k) {
+			workers.emplace_back(decode_segment, k);
+		}
+		decode_segment(0);
+		for (auto &worker : workers) {
+			worker.join();
+		}
+		for (auto const &seg : segs) {
+			if (seg.error) std::rethrow_exception(seg.error);
+		}
+
+		//stitch:
+		decoded = segs[0].decoded;
+		for (uint32_t k = 1; k < segments; ++k) {
+			Segment &prev = segs[k-1];
+			Segment &seg = segs[k];
+			if (decoded < bounds[k]) break; //file ended early
+			size_t size = bounds[k+1] - bounds[k];
+			size_t checked = prev.check.size();
+			bool matches = (seg.decoded >= std::min(checked, size)
+				&& std::memcmp(prev.check.data(), data.data() + bounds[k], checked * sizeof(float)) == 0);
+			if (!matches) {
+				//continue the previous segment's decoder, which is positioned right after its check samples:
+				redecoded += 1;
+				std::copy(prev.check.begin(), prev.check.end(), data.begin() + bounds[k]);
+				seg.decoded = checked + decode(prev.op.get(), mono, data.data() + bounds[k] + checked, size - checked, prev.pcm, filename);
+				if (k + 1 < segments) {
+					seg.check.resize(std::min(SegmentCheck, size_t(length) - bounds[k+1]));
+					seg.check.resize(decode(prev.op.get(), mono, seg.check.data(), seg.check.size(), prev.pcm, filename));
+				}
+				seg.op = std::move(prev.op);
 			}
-			if (ret == 0) break;
-		} else {
+			decoded = bounds[k] + seg.decoded;
+		}
+		data.resize(decoded);
+
+		parallel_loads += 1;
+		parallel_segments += segments - 1;
+		redecoded_segments += redecoded;
+	}
+
+	double seconds = std::chrono::duration< double >(std::chrono::steady_clock::now() - before).count();
+
+	//(printed as one string since loads may be happening on several threads at once)
+	std::string segment_info;
+	if (segments > 1) segment_info = ", " + std::to_string(segments) + " segments (" + std::to_string(redecoded) + " re-decoded)";
+	std::cout << ("loaded '" + filename + "' (" + std::to_string(decoded) + " samples, "
+		+ (mono ? "mono" : "stereo") + segment_info + "; " + std::to_string(int64_t(decoded / std::max(seconds, 1e-9))) + " samples/sec).\n");
+	std::cout.flush();
+}
+
+OpusLoadStats get_opus_load_stats() {
+	OpusLoadStats stats;
+	stats.parallel_loads = parallel_loads.load();
+	stats.segments = parallel_segments.load();
+	stats.redecoded = redecoded_segments.load();
+	return stats;
+}
+
+OpusReader::OpusReader(std::string const &filename_) : filename(filename_) {
+	int err = 0;
+	op = op_open_file(filename.c_str(), &err);
+	if (err != 0 || !op) {
+		throw std::runtime_error("opusfile error " + std::to_string(err) + " opening \"" + filename + "\".");
+	}
+	pcm.resize(2*5760); //120ms (the longest opus frame) of stereo
+}
+
+OpusReader::OpusReader(std::string const &name, uint8_t const *bytes, size_t size) : filename(name) {
+	int err = 0;
+	op = op_open_memory(bytes, size, &err);
+	if (err != 0 || !op) {
+		throw std::runtime_error("opusfile error " + std::to_string(err) + " opening \"" + filename + "\".");
+	}
+	pcm.resize(2*5760); //120ms (the longest opus frame) of stereo
+}
+
+OpusReader::~OpusReader() {
+	if (op) op_free(op);
+	op = nullptr;
+}
+
+uint32_t OpusReader::read(float *data, uint32_t count) {
+	uint32_t total = 0;
+	while (total < count) {
+		uint32_t want = std::min(count - total, uint32_t(pcm.size() / 2));
+		int ret = op_read_float_stereo(op, pcm.data(), int(2 * want));
+		if (ret < 0) {
 			throw std::runtime_error("opusfile read error " + std::to_string(ret) + " reading \"" + filename + "\".");
 		}
+		if (ret == 0) break; //end of file
+		downmix_stereo_to_mono(data + total, pcm.data(), uint32_t(ret));
+		total += uint32_t(ret);
 	}
+	return total;
+}
 
-	std::cout << " done." << std::endl;
+uint64_t OpusReader::length() const {
+	ogg_int64_t total = op_pcm_total(op, -1);
+	if (total < 0) {
+		throw std::runtime_error("opusfile error " + std::to_string(total) + " getting length of \"" + filename + "\".");
+	}
+	return uint64_t(total);
+}
+
+void OpusReader::seek(uint64_t position) {
+	int ret = op_pcm_seek(op, ogg_int64_t(position));
+	if (ret != 0) {
+		throw std::runtime_error("opusfile seek error " + std::to_string(ret) + " seeking in \"" + filename + "\".");
+	}
 }
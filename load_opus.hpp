@@ -2,6 +2,50 @@
 
 #include <string>
 #include <vector>
+#include <cstdint>
 
 //Load an opus file as 48kHz floating-point mono; throws on error:
-void load_opus(std::string const &filename, std::vector< float > *data);
+// long files (a minute or more) are split into segments that are decoded on up to 'threads' threads at once
+// (0 = one per core; 1 = always decode serially).
+// Each segment is checked against the end of the one before it over a 100ms overlap and re-decoded serially
+// if they differ, so the result matches a serial decode as long as a 100ms match means the decoders have converged
+// (this is assumed, not guaranteed -- see get_opus_load_stats for how often the serial re-decode is needed).
+// Threads are shared between all load_opus calls in progress: a call only uses cores that no other decode is using
+// (so, e.g., loading several files at once on Load<> worker threads decodes each one serially).
+void load_opus(std::string const &filename, std::vector< float > *data, uint32_t threads = 0);
+
+//Segment counts over all load_opus calls so far:
+struct OpusLoadStats {
+	uint32_t parallel_loads = 0; //calls that decoded in more than one segment
+	uint32_t segments = 0; //segments decoded by those calls, after the first of each
+	uint32_t redecoded = 0; //..of which didn't match the segment before and were re-decoded serially
+};
+OpusLoadStats get_opus_load_stats();
+
+//Incrementally decode an opus file as 48kHz floating-point mono
+// (used for streaming playback -- see Sound::Stream -- and Opus-format samples):
+struct OggOpusFile;
+struct OpusReader {
+	//open a file; throws on error:
+	OpusReader(std::string const &filename);
+	//..or the contents of an opus file already in memory (which must outlive the reader; 'name' is used in error messages):
+	OpusReader(std::string const &name, uint8_t const *bytes, size_t size);
+	~OpusReader();
+
+	//total length of the file, in samples:
+	uint64_t length() const;
+
+	//decode up to 'count' samples into 'data'; returns the number decoded (0 at end of file); throws on error:
+	uint32_t read(float *data, uint32_t count);
+
+	//go to sample 'position' (or back to the start of the file); throws on error:
+	void seek(uint64_t position);
+	void rewind() { seek(0); }
+
+	//internals:
+	std::string filename;
+	OggOpusFile *op = nullptr;
+	std::vector< float > pcm; //stereo decode buffer
+
+	OpusReader(OpusReader const &) = delete;
+};
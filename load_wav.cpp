@@ -1,50 +1,260 @@
 #include "load_wav.hpp"
 
+#include "MappedFile.hpp"
+
 #include <SDL.h>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
 #include <iostream>
+#include <fstream>
 #include <cassert>
+#include <cstring>
 #include <algorithm>
 
 constexpr uint32_t AUDIO_RATE = 48000;
 
-void load_wav(std::string const &filename, std::vector< float > *data_) {
+namespace {
+	//little-endian helpers for reading headers (WAV files are little-endian, as are all the platforms we build for):
+	inline uint16_t read_u16(char const *at) { uint16_t v; std::memcpy(&v, at, 2); return v; }
+	inline uint32_t read_u32(char const *at) { uint32_t v; std::memcpy(&v, at, 4); return v; }
+
+	//sample encodings this loader handles:
+	enum class Encoding {
+		U8, //8-bit unsigned PCM
+		S16, //16-bit signed PCM
+		S24, //24-bit signed PCM
+		S32, //32-bit signed PCM
+		F32, //32-bit float
+	};
+
+	//convert 'frames' frames of 'channels'-channel audio to mono float (averaging channels):
+	// (the common cases -- 16-bit and float, mono and stereo -- use SSE2; the rest are plain loops)
+	void convert_to_mono(char const *src, Encoding encoding, uint32_t channels, size_t frames, float *dst) {
+		size_t i = 0;
+		float const scale = 1.0f / float(channels);
+
+#if defined(__SSE2__) || defined(_M_X64)
+		if (encoding == Encoding::S16 && (channels == 1 || channels == 2)) {
+			__m128 const s = _mm_set1_ps(scale / 32768.0f);
+			for (; i + 8 <= frames; i += 8) {
+				//load 8 frames' worth of samples and sign-extend to 32-bit:
+				__m128i a = _mm_loadu_si128(reinterpret_cast< __m128i const * >(src + i * channels * 2));
+				__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(a, a), 16);
+				__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(a, a), 16);
+				if (channels == 1) {
+					_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), s));
+					_mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), s));
+				} else {
+					__m128i b = _mm_loadu_si128(reinterpret_cast< __m128i const * >(src + i * 4 + 16));
+					__m128i lo2 = _mm_srai_epi32(_mm_unpacklo_epi16(b, b), 16);
+					__m128i hi2 = _mm_srai_epi32(_mm_unpackhi_epi16(b, b), 16);
+					//lo, hi, lo2, hi2 hold L R L R; add the pairs:
+					__m128 f0 = _mm_cvtepi32_ps(lo), f1 = _mm_cvtepi32_ps(hi);
+					__m128 f2 = _mm_cvtepi32_ps(lo2), f3 = _mm_cvtepi32_ps(hi2);
+					__m128 sum0 = _mm_add_ps(_mm_shuffle_ps(f0, f1, _MM_SHUFFLE(2,0,2,0)), _mm_shuffle_ps(f0, f1, _MM_SHUFFLE(3,1,3,1)));
+					__m128 sum1 = _mm_add_ps(_mm_shuffle_ps(f2, f3, _MM_SHUFFLE(2,0,2,0)), _mm_shuffle_ps(f2, f3, _MM_SHUFFLE(3,1,3,1)));
+					_mm_storeu_ps(dst + i, _mm_mul_ps(sum0, s));
+					_mm_storeu_ps(dst + i + 4, _mm_mul_ps(sum1, s));
+				}
+			}
+		} else if (encoding == Encoding::F32 && (channels == 1 || channels == 2)) {
+			__m128 const s = _mm_set1_ps(scale);
+			for (; i + 4 <= frames; i += 4) {
+				float const *f = reinterpret_cast< float const * >(src) + i * channels; //(only used with unaligned loads)
+				if (channels == 1) {
+					_mm_storeu_ps(dst + i, _mm_loadu_ps(f));
+				} else {
+					__m128 a = _mm_loadu_ps(f), b = _mm_loadu_ps(f + 4);
+					__m128 sum = _mm_add_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0)), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1)));
+					_mm_storeu_ps(dst + i, _mm_mul_ps(sum, s));
+				}
+			}
+		}
+#endif
+
+		//everything else (and whatever is left over):
+		auto convert = [&](uint32_t bytes, auto &&read) {
+			for (; i < frames; ++i) {
+				char const *frame = src + i * channels * bytes;
+				float sum = 0.0f;
+				for (uint32_t c = 0; c < channels; ++c) {
+					sum += read(frame + c * bytes);
+				}
+				dst[i] = sum * scale;
+			}
+		};
+		if (encoding == Encoding::U8) {
+			convert(1, [](char const *at) { return (float(uint8_t(*at)) - 128.0f) * (1.0f / 128.0f); });
+		} else if (encoding == Encoding::S16) {
+			convert(2, [](char const *at) { return float(int16_t(read_u16(at))) * (1.0f / 32768.0f); });
+		} else if (encoding == Encoding::S24) {
+			convert(3, [](char const *at) {
+				int32_t v = int32_t(uint32_t(uint8_t(at[0])) << 8 | uint32_t(uint8_t(at[1])) << 16 | uint32_t(uint8_t(at[2])) << 24) >> 8;
+				return float(v) * (1.0f / 8388608.0f);
+			});
+		} else if (encoding == Encoding::S32) {
+			convert(4, [](char const *at) { return float(int32_t(read_u32(at))) * (1.0f / 2147483648.0f); });
+		} else if (encoding == Encoding::F32) {
+			convert(4, [](char const *at) { float v; std::memcpy(&v, at, 4); return v; });
+		}
+	}
+
+	//load (and convert) a WAV file with SDL_LoadWAV + SDL_AudioCVT:
+	// used for encodings convert_to_mono doesn't handle (e.g., IMA/MS ADPCM, mu-law, A-law), which SDL decodes itself.
+	void load_wav_with_sdl(std::string const &filename, std::vector< float > *data_, uint32_t *rate) {
+		auto &data = *data_;
+
+		SDL_AudioSpec audio_spec;
+		Uint8 *audio_buf = nullptr;
+		Uint32 audio_len = 0;
+
+		SDL_AudioSpec *have = SDL_LoadWAV(filename.c_str(), &audio_spec, &audio_buf, &audio_len);
+		if (!have) {
+			throw std::runtime_error("Failed to load WAV file '" + filename + "'; SDL says \"" + std::string(SDL_GetError()) + "\"");
+		}
+
+		//convert to mono float, at the file's rate if the caller handles any rate or at 48kHz otherwise:
+		int want_rate = (rate ? have->freq : int(AUDIO_RATE));
+		if (rate) *rate = uint32_t(have->freq);
+
+		//based on the SDL_AudioCVT example in the docs: https://wiki.libsdl.org/SDL_AudioCVT
+		SDL_AudioCVT cvt;
+		if (SDL_BuildAudioCVT(&cvt, have->format, have->channels, have->freq, AUDIO_F32SYS, 1, want_rate) < 0) {
+			SDL_FreeWAV(audio_buf);
+			throw std::runtime_error("Failed to convert WAV file '" + filename + "'; SDL says \"" + std::string(SDL_GetError()) + "\"");
+		}
+		cvt.len = int(audio_len);
+		std::vector< Uint8 > buf(size_t(cvt.len) * cvt.len_mult);
+		std::memcpy(buf.data(), audio_buf, audio_len);
+		SDL_FreeWAV(audio_buf);
+		cvt.buf = buf.data();
+		SDL_ConvertAudio(&cvt);
+		int final_size = cvt.len_cvt;
+		assert(final_size >= 0 && final_size <= cvt.len * cvt.len_mult && "Converted audio should fit in buffer.");
+		assert(final_size % 4 == 0 && "Converted audio should consist of 4-byte elements.");
+		data.resize(size_t(final_size) / sizeof(float));
+		std::memcpy(data.data(), buf.data(), size_t(final_size));
+	}
+}
+
+void load_wav(std::string const &filename, std::vector< float > *data_, uint32_t *rate) {
 	assert(data_);
 	auto &data = *data_;
 
-	SDL_AudioSpec audio_spec;
-	Uint8 *audio_buf = nullptr;
-	Uint32 audio_len = 0;
+	//the file is mapped, and samples are converted straight from the mapping into 'data':
+	MappedFile file(filename);
+	auto fail = [&filename](std::string const &why) {
+		throw std::runtime_error("Failed to load WAV file '" + filename + "': " + why);
+	};
+	if (file.size < 12 || std::memcmp(file.data, "RIFF", 4) != 0 || std::memcmp(file.data + 8, "WAVE", 4) != 0) {
+		fail("not a RIFF WAVE file.");
+	}
+
+	//find the 'fmt ' and 'data' chunks:
+	char const *fmt = nullptr;
+	uint32_t fmt_size = 0;
+	char const *samples = nullptr;
+	size_t samples_size = 0;
+	for (size_t at = 12; at + 8 <= file.size; ) {
+		uint32_t size = read_u32(file.data + at + 4);
+		char const *contents = file.data + at + 8;
+		size_t available = file.size - (at + 8);
+		if (std::memcmp(file.data + at, "fmt ", 4) == 0) {
+			if (size > available) fail("truncated 'fmt ' chunk.");
+			fmt = contents;
+			fmt_size = size;
+		} else if (std::memcmp(file.data + at, "data", 4) == 0) {
+			//(some writers leave the data size as 0 or too big when streaming; use what's there)
+			samples = contents;
+			samples_size = (size == 0 || size > available ? available : size);
+		}
+		at += 8 + size_t(size) + (size & 1); //chunks are padded to even sizes
+	}
+	if (!fmt || fmt_size < 16) fail("missing 'fmt ' chunk.");
+	if (!samples) fail("missing 'data' chunk.");
+
+	uint16_t format_tag = read_u16(fmt + 0);
+	uint16_t channels = read_u16(fmt + 2);
+	uint32_t file_rate = read_u32(fmt + 4);
+	uint16_t bits = read_u16(fmt + 14);
+	if (format_tag == 0xFFFE && fmt_size >= 40) {
+		//WAVE_FORMAT_EXTENSIBLE: real format is at the start of the subformat GUID
+		format_tag = read_u16(fmt + 24);
+	}
 
-	SDL_AudioSpec *have = SDL_LoadWAV(filename.c_str(), &audio_spec, &audio_buf, &audio_len);
-	if (!have) {
-		throw std::runtime_error("Failed to load WAV file '" + filename + "'; SDL says \"" + std::string(SDL_GetError()) + "\"");
+	Encoding encoding;
+	if (format_tag == 1 && bits == 8) encoding = Encoding::U8;
+	else if (format_tag == 1 && bits == 16) encoding = Encoding::S16;
+	else if (format_tag == 1 && bits == 24) encoding = Encoding::S24;
+	else if (format_tag == 1 && bits == 32) encoding = Encoding::S32;
+	else if (format_tag == 3 && bits == 32) encoding = Encoding::F32;
+	else {
+		//other encodings (ADPCM, mu-law, A-law, ...) are left to SDL:
+		load_wav_with_sdl(filename, data_, rate);
+		return;
 	}
+	if (channels == 0 || file_rate == 0) fail("bad 'fmt ' chunk.");
+
+	size_t frame_bytes = size_t(channels) * (bits / 8);
+	size_t frames = samples_size / frame_bytes;
+	data.resize(frames);
+	convert_to_mono(samples, encoding, channels, frames, data.data());
 
-	//based on the SDL_AudioCVT example in the docs: https://wiki.libsdl.org/SDL_AudioCVT
-	SDL_AudioCVT cvt;
-	SDL_BuildAudioCVT(&cvt, have->format, have->channels, have->freq, AUDIO_F32SYS, 1, AUDIO_RATE);
-	if (cvt.needed) {
-		std::cout << "WAV file '" + filename + "' didn't load as " + std::to_string(AUDIO_RATE) + " Hz, float32, mono; converting." << std::endl;
-		cvt.len = audio_len;
-		cvt.buf = (Uint8 *)SDL_malloc(cvt.len * cvt.len_mult);
-		SDL_memcpy(cvt.buf, audio_buf, audio_len);
+	if (rate) {
+		//caller handles any sampling rate:
+		*rate = file_rate;
+	} else if (file_rate != AUDIO_RATE) {
+		//caller wants 48kHz; have SDL convert the (now mono float) samples:
+		std::cout << "WAV file '" + filename + "' is " + std::to_string(file_rate) + " Hz; converting to " + std::to_string(AUDIO_RATE) + " Hz." << std::endl;
+		//based on the SDL_AudioCVT example in the docs: https://wiki.libsdl.org/SDL_AudioCVT
+		SDL_AudioCVT cvt;
+		SDL_BuildAudioCVT(&cvt, AUDIO_F32SYS, 1, int(file_rate), AUDIO_F32SYS, 1, AUDIO_RATE);
+		cvt.len = int(data.size() * sizeof(float));
+		std::vector< Uint8 > buf(size_t(cvt.len) * cvt.len_mult);
+		std::memcpy(buf.data(), data.data(), size_t(cvt.len));
+		cvt.buf = buf.data();
 		SDL_ConvertAudio(&cvt);
 		int final_size = cvt.len_cvt;
 		assert(final_size >= 0 && final_size <= cvt.len * cvt.len_mult && "Converted audio should fit in buffer.");
 		assert(final_size % 4 == 0 && "Converted audio should consist of 4-byte elements.");
-		data.assign(reinterpret_cast< float * >(cvt.buf), reinterpret_cast< float * >(cvt.buf + final_size));
-		SDL_free(cvt.buf);
-	} else {
-		data.assign(reinterpret_cast< float * >(audio_buf), reinterpret_cast< float * >(audio_buf + audio_len));
+		data.resize(size_t(final_size) / sizeof(float));
+		std::memcpy(data.data(), buf.data(), size_t(final_size));
 	}
-	SDL_FreeWAV(audio_buf);
+}
+
+void save_wav(std::string const &filename, std::vector< float > const &stereo, uint32_t rate) {
+	std::ofstream out(filename, std::ios::binary);
+	if (!out) {
+		throw std::runtime_error("Failed to open '" + filename + "' for writing.");
+	}
+
+	//(WAV files are little-endian, as are all the platforms we build for)
+	auto write_u32 = [&out](uint32_t v) { out.write(reinterpret_cast< char const * >(&v), 4); };
+	auto write_u16 = [&out](uint16_t v) { out.write(reinterpret_cast< char const * >(&v), 2); };
+
+	uint32_t data_size = uint32_t(stereo.size() * sizeof(float));
+
+	out.write("RIFF", 4);
+	write_u32(4 + (8 + 16) + (8 + data_size));
+	out.write("WAVE", 4);
+
+	out.write("fmt ", 4);
+	write_u32(16);
+	write_u16(3); //WAVE_FORMAT_IEEE_FLOAT
+	write_u16(2); //channels
+	write_u32(rate);
+	write_u32(rate * 2 * sizeof(float)); //bytes per second
+	write_u16(2 * sizeof(float)); //bytes per frame
+	write_u16(32); //bits per sample
+
+	out.write("data", 4);
+	write_u32(data_size);
+	out.write(reinterpret_cast< char const * >(stereo.data()), data_size);
 
-	float min = 0.0f;
-	float max = 0.0f;
-	for (auto d : data) {
-		min = std::min(min, d);
-		max = std::max(max, d);
+	if (!out) {
+		throw std::runtime_error("Failed to write '" + filename + "'.");
 	}
-	std::cout << "Range: " << min << ", " << max << std::endl;
 }
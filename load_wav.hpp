@@ -1,7 +1,15 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
 //Load a WAV file as 48kHz floating-point mono; throws on error:
-void load_wav(std::string const &filename, std::vector< float > *data);
+// (if 'rate' is given, the file's sampling rate is kept -- and stored in *rate -- instead of converting to 48kHz)
+// reads 8/16/24/32-bit integer and 32-bit float PCM; the file is memory-mapped and converted in a single pass.
+// (other encodings -- ADPCM, mu-law, A-law -- are loaded and converted by SDL instead, as they were before)
+void load_wav(std::string const &filename, std::vector< float > *data, uint32_t *rate = nullptr);
+
+//Save interleaved stereo floating-point samples as a (32-bit float) WAV file; throws on error:
+// (used to capture offline mixer output -- see Sound::mix_offline)
+void save_wav(std::string const &filename, std::vector< float > const &stereo, uint32_t rate = 48000);
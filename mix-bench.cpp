@@ -0,0 +1,431 @@
+//mix-bench: benchmarks for the audio mixer.
+// compares the old per-sample mixing loop (with a wrap check on every sample)
+// against the span-splitting + SIMD kernel used by Sound.cpp,
+// and per-source 3D panning (std::cos/std::sin) against the batched polynomial version,
+// and times the windowed-sinc resampler (scalar and SIMD) against plain mixing,
+// and times load_wav against the SDL_LoadWAV + SDL_AudioCVT path it replaced
+// (and, if an opus file is given, serial against parallel load_opus),
+// then checks that empty samples are refused and runs the whole mixer offline (no audio device) with 1, 16, 256, and 1024 voices,
+// compares the mixer's CPU cost at each output latency setting,
+// and finally mixes 1024 voices with 0 and with (cores - 1) mix worker threads.
+//
+// usage: mix-bench [voices] [out.wav] [music.opus]
+//  (if out.wav is given, the first second of the 16-voice offline mix is saved to it)
+
+#include "mix_kernels.hpp"
+#include "Sound.hpp"
+#include "load_wav.hpp"
+#include "load_opus.hpp"
+
+#include <SDL.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+namespace {
+	constexpr uint32_t const MIX_SAMPLES = 128; //same (internal) block size as Sound.cpp
+
+	//WAV loading as it was done before load_wav parsed files itself:
+	void load_wav_reference(std::string const &filename, std::vector< float > *data) {
+		SDL_AudioSpec audio_spec;
+		Uint8 *audio_buf = nullptr;
+		Uint32 audio_len = 0;
+		SDL_AudioSpec *have = SDL_LoadWAV(filename.c_str(), &audio_spec, &audio_buf, &audio_len);
+		if (!have) {
+			throw std::runtime_error("Failed to load WAV file '" + filename + "'; SDL says \"" + std::string(SDL_GetError()) + "\"");
+		}
+		SDL_AudioCVT cvt;
+		SDL_BuildAudioCVT(&cvt, have->format, have->channels, have->freq, AUDIO_F32SYS, 1, have->freq);
+		cvt.len = audio_len;
+		cvt.buf = (Uint8 *)SDL_malloc(cvt.len * cvt.len_mult);
+		SDL_memcpy(cvt.buf, audio_buf, audio_len);
+		SDL_ConvertAudio(&cvt);
+		data->assign(reinterpret_cast< float * >(cvt.buf), reinterpret_cast< float * >(cvt.buf + cvt.len_cvt));
+		SDL_free(cvt.buf);
+		SDL_FreeWAV(audio_buf);
+	}
+
+	struct Voice {
+		std::vector< float > const *data = nullptr;
+		uint32_t i = 0;
+		float gain_l = 0.0f, gain_r = 0.0f;
+		float step_l = 0.0f, step_r = 0.0f;
+	};
+}
+
+//the mixing loop as it was written before the SIMD kernel:
+void mix_block_reference(std::vector< Voice > &voices, float *buffer) {
+	for (auto &v : voices) {
+		float l = v.gain_l;
+		float r = v.gain_r;
+		for (uint32_t i = 0; i < MIX_SAMPLES; ++i) {
+			buffer[2*i+0] += l * (*v.data)[v.i];
+			buffer[2*i+1] += r * (*v.data)[v.i];
+			v.i += 1;
+			if (v.i == v.data->size()) v.i = 0;
+			l += v.step_l;
+			r += v.step_r;
+		}
+	}
+}
+
+//the mixing loop as it is written in Sound.cpp:
+void mix_block_spans(std::vector< Voice > &voices, float *buffer) {
+	for (auto &v : voices) {
+		float l = v.gain_l;
+		float r = v.gain_r;
+		uint32_t mixed = 0;
+		while (mixed < MIX_SAMPLES) {
+			uint32_t count = std::min(MIX_SAMPLES - mixed, uint32_t(v.data->size()) - v.i);
+			mix_mono_to_stereo(buffer + 2*mixed, v.data->data() + v.i, count, l, r, v.step_l, v.step_r);
+			l += v.step_l * count;
+			r += v.step_r * count;
+			mixed += count;
+			v.i += count;
+			if (v.i == v.data->size()) v.i = 0;
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	uint32_t voice_count = 256;
+	if (argc > 1) voice_count = uint32_t(std::max(1, std::atoi(argv[1])));
+
+	//a few samples of awkward lengths so that voices wrap mid-block:
+	std::vector< std::vector< float > > samples;
+	for (uint32_t length : {48000u, 12345u, 777u, 4099u}) {
+		samples.emplace_back(length);
+		for (uint32_t i = 0; i < length; ++i) {
+			samples.back()[i] = std::sin(float(i) * 0.05f);
+		}
+	}
+
+	std::vector< Voice > voices(voice_count);
+	for (uint32_t v = 0; v < voice_count; ++v) {
+		voices[v].data = &samples[v % samples.size()];
+		voices[v].i = (v * 131) % uint32_t(voices[v].data->size());
+		voices[v].gain_l = 0.5f;
+		voices[v].gain_r = 0.25f;
+		voices[v].step_l = -0.1f / MIX_SAMPLES;
+		voices[v].step_r = 0.2f / MIX_SAMPLES;
+	}
+
+	auto run = [&](char const *name, void (*mix_block)(std::vector< Voice > &, float *), std::vector< float > *first_block) {
+		std::vector< Voice > state = voices;
+		std::vector< float > buffer(2 * MIX_SAMPLES, 0.0f);
+		mix_block(state, buffer.data());
+		*first_block = buffer;
+
+		constexpr uint32_t const Blocks = 500;
+		auto before = std::chrono::high_resolution_clock::now();
+		for (uint32_t b = 0; b < Blocks; ++b) {
+			std::fill(buffer.begin(), buffer.end(), 0.0f);
+			mix_block(state, buffer.data());
+		}
+		auto after = std::chrono::high_resolution_clock::now();
+		double ms = std::chrono::duration< double >(after - before).count() * 1000.0 / Blocks;
+
+		std::cout << name << ": " << ms << " ms per " << MIX_SAMPLES << "-sample block; "
+		          << (voice_count / ms) << " voices per ms." << std::endl;
+	};
+
+	std::cout << "Mixing " << voice_count << " voices." << std::endl;
+	std::vector< float > reference, spans;
+	run("  reference (per-sample)", mix_block_reference, &reference);
+	run("  spans + SIMD          ", mix_block_spans, &spans);
+
+	float max_error = 0.0f;
+	for (uint32_t i = 0; i < reference.size(); ++i) {
+		max_error = std::max(max_error, std::abs(reference[i] - spans[i]));
+	}
+	std::cout << "  max difference: " << max_error << std::endl;
+
+	//---- 3D panning ----
+	{
+		constexpr uint32_t const Sources = 4096;
+		std::vector< float > x(Sources), y(Sources), z(Sources), half_radius(Sources), volume(Sources);
+		for (uint32_t i = 0; i < Sources; ++i) {
+			x[i] = float(i % 17) - 8.0f;
+			y[i] = float(i % 5) - 2.0f;
+			z[i] = float(i % 3) * 0.5f;
+			half_radius[i] = (i % 4 == 0 ? std::numeric_limits< float >::infinity() : 1.0f + float(i % 9));
+			volume[i] = 0.5f;
+		}
+		float listener[3] = { 0.0f, 0.0f, 0.0f };
+		float right[3] = { 0.6f, 0.8f, 0.0f };
+
+		auto run_pan = [&](char const *name, decltype(&compute_pan_gains_3D) pan, std::vector< float > *left, std::vector< float > *right_gains) {
+			left->resize(Sources);
+			right_gains->resize(Sources);
+			constexpr uint32_t const Reps = 2000;
+			auto before = std::chrono::high_resolution_clock::now();
+			for (uint32_t r = 0; r < Reps; ++r) {
+				listener[2] = float(r % 2) * 0.01f; //(so the work can't be hoisted out of the loop)
+				pan(Sources, x.data(), y.data(), z.data(), half_radius.data(), volume.data(), listener, right, left->data(), right_gains->data());
+			}
+			auto after = std::chrono::high_resolution_clock::now();
+			double us = std::chrono::duration< double >(after - before).count() * 1.0e6 / Reps;
+			std::cout << name << ": " << us << " us per " << Sources << " sources; "
+			          << (1000.0 * us / Sources) << " ns per source." << std::endl;
+		};
+
+		std::cout << "Panning " << Sources << " 3D sources." << std::endl;
+		std::vector< float > ref_l, ref_r, batch_l, batch_r;
+		run_pan("  reference (std::cos/sin)", compute_pan_gains_3D_reference, &ref_l, &ref_r);
+		run_pan("  batch + polynomial      ", compute_pan_gains_3D, &batch_l, &batch_r);
+
+		float max_pan_error = 0.0f;
+		for (uint32_t i = 0; i < Sources; ++i) {
+			max_pan_error = std::max(max_pan_error, std::max(std::abs(ref_l[i] - batch_l[i]), std::abs(ref_r[i] - batch_r[i])));
+		}
+		std::cout << "  max difference: " << max_pan_error << std::endl;
+	}
+
+	//---- resampling ----
+	{
+		std::vector< float > const &src = samples[0];
+		uint64_t const step = uint64_t(1.37 * 4294967296.0); //(an awkward rate)
+		std::vector< float > buffer(2 * MIX_SAMPLES, 0.0f);
+		auto run_resample = [&](char const *name, auto &&mix) {
+			constexpr uint32_t const Reps = 20000;
+			auto before = std::chrono::high_resolution_clock::now();
+			for (uint32_t r = 0; r < Reps; ++r) {
+				mix(r);
+			}
+			auto after = std::chrono::high_resolution_clock::now();
+			double ns = std::chrono::duration< double >(after - before).count() * 1.0e9 / (double(Reps) * MIX_SAMPLES);
+			std::cout << name << ": " << ns << " ns per output sample." << std::endl;
+		};
+		std::cout << "Resampling (" << ResampleTaps << " taps):" << std::endl;
+		run_resample("  plain mix (rate 1.0)   ", [&](uint32_t r) {
+			mix_mono_to_stereo(buffer.data(), src.data() + 16 + (r % 1000), MIX_SAMPLES, 0.5f, 0.25f, 0.0f, 0.0f);
+		});
+		run_resample("  resample, scalar       ", [&](uint32_t r) {
+			resample_mono_to_stereo_scalar(buffer.data(), src.data() + 16 + (r % 1000), MIX_SAMPLES, uint64_t(r) << 20, step, 0.5f, 0.25f, 0.0f, 0.0f);
+		});
+		run_resample("  resample, SIMD         ", [&](uint32_t r) {
+			resample_mono_to_stereo(buffer.data(), src.data() + 16 + (r % 1000), MIX_SAMPLES, uint64_t(r) << 20, step, 0.5f, 0.25f, 0.0f, 0.0f);
+		});
+	}
+
+	//---- WAV loading ----
+	{
+		//three minutes of 16-bit stereo, written to a temporary file:
+		std::string const filename = "mix-bench-temp.wav";
+		uint32_t const frames = 3 * 60 * 48000;
+		{
+			std::ofstream out(filename, std::ios::binary);
+			auto write_u32 = [&out](uint32_t v) { out.write(reinterpret_cast< char const * >(&v), 4); };
+			auto write_u16 = [&out](uint16_t v) { out.write(reinterpret_cast< char const * >(&v), 2); };
+			out.write("RIFF", 4);
+			write_u32(4 + (8 + 16) + (8 + frames * 4));
+			out.write("WAVE", 4);
+			out.write("fmt ", 4);
+			write_u32(16);
+			write_u16(1); //WAVE_FORMAT_PCM
+			write_u16(2); //channels
+			write_u32(48000);
+			write_u32(48000 * 4); //bytes per second
+			write_u16(4); //bytes per frame
+			write_u16(16); //bits per sample
+			out.write("data", 4);
+			write_u32(frames * 4);
+			std::vector< int16_t > pcm(2 * frames);
+			for (uint32_t i = 0; i < frames; ++i) {
+				pcm[2*i+0] = int16_t(20000.0f * std::sin(float(i % 48000) * 0.0371f));
+				pcm[2*i+1] = int16_t(int32_t(i * 2654435761u) >> 18); //(noise)
+			}
+			out.write(reinterpret_cast< char const * >(pcm.data()), pcm.size() * 2);
+			if (!out) {
+				throw std::runtime_error("Failed to write '" + filename + "'.");
+			}
+		}
+
+		auto run_load = [&](char const *name, auto &&load, std::vector< float > *data) {
+			double best_ms = std::numeric_limits< double >::infinity();
+			for (uint32_t r = 0; r < 5; ++r) {
+				auto before = std::chrono::high_resolution_clock::now();
+				load(data);
+				auto after = std::chrono::high_resolution_clock::now();
+				best_ms = std::min(best_ms, std::chrono::duration< double >(after - before).count() * 1000.0);
+			}
+			std::cout << name << ": " << best_ms << " ms (best of 5); "
+			          << (frames / 48000.0) / (best_ms / 1000.0) << "x real time." << std::endl;
+		};
+		std::cout << "Loading " << (frames / 48000) << " seconds of 16-bit stereo WAV:" << std::endl;
+		std::vector< float > reference, loaded;
+		run_load("  SDL_LoadWAV + SDL_AudioCVT", [&](std::vector< float > *data) { load_wav_reference(filename, data); }, &reference);
+		run_load("  load_wav                  ", [&](std::vector< float > *data) { uint32_t rate; load_wav(filename, data, &rate); }, &loaded);
+		std::remove(filename.c_str());
+
+		//(SDL scales 16-bit samples the same way, but may round differently when mixing down to mono)
+		float max_load_error = 0.0f;
+		for (size_t i = 0; i < std::min(reference.size(), loaded.size()); ++i) {
+			max_load_error = std::max(max_load_error, std::abs(reference[i] - loaded[i]));
+		}
+		std::cout << "  " << loaded.size() << " vs. " << reference.size() << " samples; max difference: " << max_load_error << std::endl;
+	}
+
+	//---- opus loading ----
+	if (argc > 3) {
+		std::string const opus_file = argv[3];
+		uint32_t cores = std::max(1U, std::thread::hardware_concurrency());
+		std::cout << "Loading '" << opus_file << "' (parallel uses up to " << cores << " threads):" << std::endl;
+		std::vector< float > serial, parallel;
+		auto run_opus = [&](char const *name, uint32_t threads, std::vector< float > *data) {
+			auto before = std::chrono::high_resolution_clock::now();
+			load_opus(opus_file, data, threads);
+			auto after = std::chrono::high_resolution_clock::now();
+			double ms = std::chrono::duration< double >(after - before).count() * 1000.0;
+			std::cout << name << ": " << ms << " ms." << std::endl;
+		};
+		run_opus("  serial             ", 1, &serial);
+		OpusLoadStats before = get_opus_load_stats();
+		run_opus("  parallel           ", cores, &parallel);
+		OpusLoadStats after = get_opus_load_stats();
+		uint32_t segments = after.segments - before.segments;
+		if (segments) {
+			std::cout << "  " << (after.redecoded - before.redecoded) << " of " << segments << " segment(s) after the first didn't match and were re-decoded serially." << std::endl;
+		} else {
+			std::cout << "  (decoded as one segment -- file too short, or only one core free.)" << std::endl;
+		}
+		size_t differing = 0;
+		for (size_t i = 0; i < std::min(serial.size(), parallel.size()); ++i) {
+			if (std::memcmp(&serial[i], &parallel[i], sizeof(float)) != 0) ++differing;
+		}
+		if (serial.size() == parallel.size() && differing == 0) {
+			std::cout << "  parallel output is bit-identical to serial." << std::endl;
+		} else {
+			std::cout << "  parallel output DIFFERS from serial: " << parallel.size() << " vs. " << serial.size() << " samples, " << differing << " differing." << std::endl;
+		}
+	}
+
+	//---- whole mixer, offline ----
+	std::string wav_file = (argc > 2 ? argv[2] : "");
+
+	std::vector< std::unique_ptr< Sound::Sample > > sound_samples;
+	for (auto const &data : samples) {
+		sound_samples.emplace_back(new Sound::Sample(data));
+	}
+
+	//empty samples should be refused (rather than, e.g., looping forever in the mixer):
+	{
+		Sound::Sample empty(std::vector< float >{});
+		Sound::Sample empty_resampled(std::vector< float >{}, Sound::Sample::Format::Float, 24000);
+		Sound::PlayingSample a = Sound::loop(empty);
+		Sound::PlayingSample b = Sound::loop_3D(empty_resampled, 1.0f, glm::vec3(1.0f, 0.0f, 0.0f));
+		Sound::mix_offline(4);
+		std::cout << "Empty looping samples: " << (!a && !b ? "refused." : "STARTED!") << std::endl;
+		Sound::stop_all_samples();
+		Sound::mix_offline(4);
+	}
+
+	//mix every voice (rather than limiting/virtualizing them) to measure the full cost:
+	Sound::set_voice_limit(1024, 0.0f);
+
+	std::cout << "Offline mixer (" << Sound::block_samples() << "-sample blocks):" << std::endl;
+	for (uint32_t count : {1u, 16u, 256u, 1024u}) {
+		//clear out voices from the previous run:
+		Sound::stop_all_samples();
+		Sound::mix_offline(4);
+
+		//a mix of 2D and 3D looping voices:
+		for (uint32_t v = 0; v < count; ++v) {
+			Sound::Sample const &sample = *sound_samples[v % sound_samples.size()];
+			if (v % 2 == 0) {
+				Sound::loop(sample, 0.5f / count, float(v % 7) / 3.0f - 1.0f);
+			} else {
+				Sound::loop_3D(sample, 0.5f / count, glm::vec3(float(v % 11) - 5.0f, 2.0f, 0.0f), 4.0f);
+			}
+		}
+
+		std::vector< float > out;
+		Sound::mix_offline(2, (count == 16 && wav_file != "" ? &out : nullptr)); //warm up
+
+		constexpr uint32_t const Blocks = 200;
+		auto before = std::chrono::high_resolution_clock::now();
+		Sound::mix_offline(Blocks, (count == 16 && wav_file != "" ? &out : nullptr));
+		auto after = std::chrono::high_resolution_clock::now();
+		double ms = std::chrono::duration< double >(after - before).count() * 1000.0 / Blocks;
+		double block_ms = 1000.0 * Sound::block_samples() / 48000.0;
+
+		std::cout << "  " << count << " voices: " << ms << " ms per block ("
+		          << (100.0 * ms / block_ms) << "% of real time; "
+		          << (count / ms) << " voices per ms)." << std::endl;
+
+		if (!out.empty()) {
+			out.resize(std::min< size_t >(out.size(), 2 * 48000));
+			save_wav(wav_file, out);
+			std::cout << "  (saved 16-voice mix to '" << wav_file << "')" << std::endl;
+		}
+	}
+
+	//---- latency settings ----
+	//the same 64 voices mixed with each callback size; smaller callbacks do the same work in more pieces.
+	// (n.b. this measures the mixer's own per-callback overhead, not the OS cost of waking the audio thread more often)
+	std::cout << "Latency settings (64 voices, 10 seconds of audio each):" << std::endl;
+	double base_ms = 0.0;
+	for (Sound::Latency latency : {Sound::Latency::Frames1024, Sound::Latency::Frames512, Sound::Latency::Frames256, Sound::Latency::Frames128}) {
+		Sound::set_offline_latency(latency);
+		Sound::stop_all_samples();
+		Sound::mix_offline(4);
+		for (uint32_t v = 0; v < 64; ++v) {
+			Sound::loop_3D(*sound_samples[v % sound_samples.size()], 0.5f / 64, glm::vec3(float(v % 11) - 5.0f, 2.0f, 0.0f), 4.0f);
+		}
+
+		uint32_t blocks = 10 * 48000 / Sound::block_samples();
+		Sound::mix_offline(8); //warm up
+		auto before = std::chrono::high_resolution_clock::now();
+		Sound::mix_offline(blocks);
+		auto after = std::chrono::high_resolution_clock::now();
+		double ms = std::chrono::duration< double >(after - before).count() * 1000.0;
+		if (base_ms == 0.0) base_ms = ms;
+
+		std::cout << "  " << Sound::block_samples() << " samples (" << (1000.0 * Sound::block_samples() / 48000.0) << " ms): "
+		          << (ms / blocks) << " ms per callback, "
+		          << (100.0 * ms / 10000.0) << "% CPU ("
+		          << (100.0 * (ms - base_ms) / base_ms) << "% vs. 1024)." << std::endl;
+	}
+	Sound::stop_all_samples();
+	Sound::set_offline_latency(Sound::Latency::Frames1024);
+
+	//---- mix workers ----
+	uint32_t cores = std::max(1U, std::thread::hardware_concurrency());
+	std::cout << "Mix workers (1024 voices, " << cores << " cores):" << std::endl;
+	for (uint32_t workers : {0U, std::min(cores - 1, 7U)}) {
+		Sound::set_offline_mix_workers(workers);
+		Sound::stop_all_samples();
+		Sound::mix_offline(4);
+		for (uint32_t v = 0; v < 1024; ++v) {
+			Sound::loop_3D(*sound_samples[v % sound_samples.size()], 0.5f / 1024, glm::vec3(float(v % 11) - 5.0f, 2.0f, 0.0f), 4.0f);
+		}
+
+		constexpr uint32_t const Blocks = 200;
+		Sound::mix_offline(2); //warm up
+		auto before = std::chrono::high_resolution_clock::now();
+		Sound::mix_offline(Blocks);
+		auto after = std::chrono::high_resolution_clock::now();
+		double ms = std::chrono::duration< double >(after - before).count() * 1000.0 / Blocks;
+		double block_ms = 1000.0 * Sound::block_samples() / 48000.0;
+
+		std::cout << "  " << workers << " workers: " << ms << " ms per block ("
+		          << (100.0 * ms / block_ms) << "% of real time)." << std::endl;
+		if (workers == 0 && cores == 1) break;
+	}
+	Sound::stop_all_samples();
+	Sound::set_offline_mix_workers(0);
+
+	return 0;
+}
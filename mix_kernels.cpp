@@ -0,0 +1,353 @@
+#include "mix_kernels.hpp"
+
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define MIX_KERNELS_SSE
+#endif
+
+void mix_mono_to_stereo_scalar(
+	float *dst, float const *src, uint32_t count,
+	float gain_l, float gain_r,
+	float step_l, float step_r
+) {
+	//n.b. no branches in here, so compilers can usually vectorize this on their own:
+	for (uint32_t i = 0; i < count; ++i) {
+		dst[2*i+0] += gain_l * src[i];
+		dst[2*i+1] += gain_r * src[i];
+		gain_l += step_l;
+		gain_r += step_r;
+	}
+}
+
+void mix_mono_to_stereo(
+	float *dst, float const *src, uint32_t count,
+	float gain_l, float gain_r,
+	float step_l, float step_r
+) {
+	uint32_t i = 0;
+
+#if defined(__AVX__)
+	//eight samples per iteration:
+	// gains are laid out as [L R L R L R L R] to match the interleaved output
+	if (count >= 8) {
+		__m256 gain = _mm256_setr_ps(
+			gain_l + 0.0f * step_l, gain_r + 0.0f * step_r,
+			gain_l + 1.0f * step_l, gain_r + 1.0f * step_r,
+			gain_l + 2.0f * step_l, gain_r + 2.0f * step_r,
+			gain_l + 3.0f * step_l, gain_r + 3.0f * step_r
+		);
+		__m256 step4 = _mm256_setr_ps(
+			4.0f * step_l, 4.0f * step_r, 4.0f * step_l, 4.0f * step_r,
+			4.0f * step_l, 4.0f * step_r, 4.0f * step_l, 4.0f * step_r
+		);
+		for (; i + 8 <= count; i += 8) {
+			__m256 s = _mm256_loadu_ps(src + i); //s0 .. s7
+			//duplicate each sample into an L and R slot:
+			__m256 lo = _mm256_unpacklo_ps(s, s); //s0 s0 s1 s1 | s4 s4 s5 s5
+			__m256 hi = _mm256_unpackhi_ps(s, s); //s2 s2 s3 s3 | s6 s6 s7 s7
+			__m256 a = _mm256_permute2f128_ps(lo, hi, 0x20); //s0 s0 s1 s1 s2 s2 s3 s3
+			__m256 b = _mm256_permute2f128_ps(lo, hi, 0x31); //s4 s4 s5 s5 s6 s6 s7 s7
+
+			__m256 out_a = _mm256_loadu_ps(dst + 2*i);
+			__m256 out_b = _mm256_loadu_ps(dst + 2*i + 8);
+			out_a = _mm256_add_ps(out_a, _mm256_mul_ps(a, gain));
+			gain = _mm256_add_ps(gain, step4);
+			out_b = _mm256_add_ps(out_b, _mm256_mul_ps(b, gain));
+			gain = _mm256_add_ps(gain, step4);
+			_mm256_storeu_ps(dst + 2*i, out_a);
+			_mm256_storeu_ps(dst + 2*i + 8, out_b);
+		}
+		gain_l += float(i) * step_l;
+		gain_r += float(i) * step_r;
+	}
+#elif defined(MIX_KERNELS_SSE)
+	//four samples per iteration:
+	// gains are laid out as [L R L R] to match the interleaved output
+	if (count >= 4) {
+		__m128 gain = _mm_setr_ps(gain_l, gain_r, gain_l + step_l, gain_r + step_r);
+		__m128 step2 = _mm_setr_ps(2.0f * step_l, 2.0f * step_r, 2.0f * step_l, 2.0f * step_r);
+		for (; i + 4 <= count; i += 4) {
+			__m128 s = _mm_loadu_ps(src + i); //s0 s1 s2 s3
+			//duplicate each sample into an L and R slot:
+			__m128 a = _mm_unpacklo_ps(s, s); //s0 s0 s1 s1
+			__m128 b = _mm_unpackhi_ps(s, s); //s2 s2 s3 s3
+
+			__m128 out_a = _mm_loadu_ps(dst + 2*i);
+			__m128 out_b = _mm_loadu_ps(dst + 2*i + 4);
+			out_a = _mm_add_ps(out_a, _mm_mul_ps(a, gain));
+			gain = _mm_add_ps(gain, step2);
+			out_b = _mm_add_ps(out_b, _mm_mul_ps(b, gain));
+			gain = _mm_add_ps(gain, step2);
+			_mm_storeu_ps(dst + 2*i, out_a);
+			_mm_storeu_ps(dst + 2*i + 4, out_b);
+		}
+		gain_l += float(i) * step_l;
+		gain_r += float(i) * step_r;
+	}
+#endif
+
+	//whatever is left over (or everything, if no SIMD available):
+	mix_mono_to_stereo_scalar(dst + 2*i, src + i, count - i, gain_l, gain_r, step_l, step_r);
+}
+
+//------------------
+
+namespace {
+	//cos and sin of (pi/4) * (1 + amt) for amt in [-1,1] -- i.e., equal-power left and right gains:
+	// uses Taylor polynomials for sin(u) and cos(u), |u| <= pi/4, and the angle sum identities.
+	inline void equal_power_gains(float amt, float *left, float *right) {
+		float u = 0.78539816f * amt;
+		float u2 = u * u;
+		float sin_u = u * (1.0f + u2 * (-1.0f / 6.0f + u2 * (1.0f / 120.0f + u2 * (-1.0f / 5040.0f))));
+		float cos_u = 1.0f + u2 * (-0.5f + u2 * (1.0f / 24.0f + u2 * (-1.0f / 720.0f + u2 * (1.0f / 40320.0f))));
+		*left = 0.70710678f * (cos_u - sin_u);
+		*right = 0.70710678f * (cos_u + sin_u);
+	}
+
+#if defined(MIX_KERNELS_SSE)
+	//four-wide version of the above:
+	inline void equal_power_gains(__m128 amt, __m128 *left, __m128 *right) {
+		__m128 u = _mm_mul_ps(_mm_set1_ps(0.78539816f), amt);
+		__m128 u2 = _mm_mul_ps(u, u);
+		__m128 sin_u = _mm_set1_ps(-1.0f / 5040.0f);
+		sin_u = _mm_add_ps(_mm_set1_ps(1.0f / 120.0f), _mm_mul_ps(u2, sin_u));
+		sin_u = _mm_add_ps(_mm_set1_ps(-1.0f / 6.0f), _mm_mul_ps(u2, sin_u));
+		sin_u = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(u2, sin_u));
+		sin_u = _mm_mul_ps(u, sin_u);
+		__m128 cos_u = _mm_set1_ps(1.0f / 40320.0f);
+		cos_u = _mm_add_ps(_mm_set1_ps(-1.0f / 720.0f), _mm_mul_ps(u2, cos_u));
+		cos_u = _mm_add_ps(_mm_set1_ps(1.0f / 24.0f), _mm_mul_ps(u2, cos_u));
+		cos_u = _mm_add_ps(_mm_set1_ps(-0.5f), _mm_mul_ps(u2, cos_u));
+		cos_u = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(u2, cos_u));
+		*left = _mm_mul_ps(_mm_set1_ps(0.70710678f), _mm_sub_ps(cos_u, sin_u));
+		*right = _mm_mul_ps(_mm_set1_ps(0.70710678f), _mm_add_ps(cos_u, sin_u));
+	}
+#endif
+}
+
+void compute_pan_gains_3D(
+	uint32_t count,
+	float const *x, float const *y, float const *z,
+	float const *half_radius, float const *volume,
+	float const listener[3], float const right[3],
+	float *left_gain, float *right_gain
+) {
+	uint32_t i = 0;
+
+#if defined(MIX_KERNELS_SSE)
+	//four sources per iteration:
+	{
+		__m128 lx = _mm_set1_ps(listener[0]), ly = _mm_set1_ps(listener[1]), lz = _mm_set1_ps(listener[2]);
+		__m128 rx = _mm_set1_ps(right[0]), ry = _mm_set1_ps(right[1]), rz = _mm_set1_ps(right[2]);
+		__m128 one = _mm_set1_ps(1.0f);
+		__m128 sqrt2 = _mm_set1_ps(std::sqrt(2.0f));
+		for (; i + 4 <= count; i += 4) {
+			__m128 tx = _mm_sub_ps(_mm_loadu_ps(x + i), lx);
+			__m128 ty = _mm_sub_ps(_mm_loadu_ps(y + i), ly);
+			__m128 tz = _mm_sub_ps(_mm_loadu_ps(z + i), lz);
+			__m128 distance = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, tx), _mm_mul_ps(ty, ty)), _mm_mul_ps(tz, tz)));
+			__m128 along = _mm_add_ps(_mm_add_ps(_mm_mul_ps(rx, tx), _mm_mul_ps(ry, ty)), _mm_mul_ps(rz, tz));
+
+			__m128 l, r;
+			equal_power_gains(_mm_div_ps(along, distance), &l, &r);
+
+			//attenuate with distance (and scale by volume):
+			__m128 att = _mm_div_ps(_mm_loadu_ps(volume + i), _mm_add_ps(one, _mm_div_ps(distance, _mm_loadu_ps(half_radius + i))));
+			l = _mm_mul_ps(l, att);
+			r = _mm_mul_ps(r, att);
+
+			//sources at the listener's position (whose gains above are NaN):
+			__m128 at_listener = _mm_cmpeq_ps(distance, _mm_setzero_ps());
+			__m128 centered = _mm_and_ps(at_listener, _mm_mul_ps(sqrt2, _mm_loadu_ps(volume + i)));
+			l = _mm_or_ps(centered, _mm_andnot_ps(at_listener, l));
+			r = _mm_or_ps(centered, _mm_andnot_ps(at_listener, r));
+
+			_mm_storeu_ps(left_gain + i, l);
+			_mm_storeu_ps(right_gain + i, r);
+		}
+	}
+#endif
+
+	//whatever is left over (or everything, if no SIMD available):
+	for (; i < count; ++i) {
+		float tx = x[i] - listener[0];
+		float ty = y[i] - listener[1];
+		float tz = z[i] - listener[2];
+		float distance = std::sqrt(tx * tx + ty * ty + tz * tz);
+		if (distance == 0.0f) {
+			left_gain[i] = right_gain[i] = std::sqrt(2.0f) * volume[i];
+		} else {
+			float l, r;
+			equal_power_gains((right[0] * tx + right[1] * ty + right[2] * tz) / distance, &l, &r);
+			float att = volume[i] / (1.0f + (distance / half_radius[i]));
+			left_gain[i] = l * att;
+			right_gain[i] = r * att;
+		}
+	}
+}
+
+void compute_pan_gains_3D_reference(
+	uint32_t count,
+	float const *x, float const *y, float const *z,
+	float const *half_radius, float const *volume,
+	float const listener[3], float const right[3],
+	float *left_gain, float *right_gain
+) {
+	for (uint32_t i = 0; i < count; ++i) {
+		float to[3] = { x[i] - listener[0], y[i] - listener[1], z[i] - listener[2] };
+		float distance = std::sqrt(to[0] * to[0] + to[1] * to[1] + to[2] * to[2]);
+		//start by panning based on direction.
+		//note that for a LR fade to sound uniform, sound power (squared magnitude) should remain constant.
+		if (distance == 0.0f) {
+			left_gain[i] = right_gain[i] = std::sqrt(2.0f) * volume[i];
+		} else {
+			//amt ranges from -1 (most left) to 1 (most right):
+			float amt = (right[0] * to[0] + right[1] * to[1] + right[2] * to[2]) / distance;
+			//turn into an angle from 0.0f (most left) to pi/2 (most right):
+			float ang = 0.5f * 3.1415926f * (0.5f * (amt + 1.0f));
+
+			//squared distance attenuation is realistic if there are no walls,
+			// but I'm going to use linear because it's sounds better to me.
+			// (feel free to change it, of course)
+			//want att = 0.5f at distance == half_volume_radius
+			float att = 1.0f / (1.0f + (distance / half_radius[i]));
+			left_gain[i] = std::cos(ang) * att * volume[i];
+			right_gain[i] = std::sin(ang) * att * volume[i];
+		}
+	}
+}
+
+//------------------
+
+namespace {
+	//polyphase filter tables, one per range of playback step (each with a cutoff low enough for that step):
+	constexpr uint32_t const ResampleFilters = 4;
+	constexpr float const ResampleFilterSteps[ResampleFilters] = { 1.0f, 1.5f, 2.0f, ResampleMaxStep };
+
+	struct ResampleTable {
+		ResampleTable() {
+			constexpr double Pi = 3.14159265358979323846;
+			constexpr double HalfWidth = ResampleTaps / 2;
+			for (uint32_t f = 0; f < ResampleFilters; ++f) {
+				//(a bit under Nyquist, since the filter is short)
+				double cutoff = 0.92 / ResampleFilterSteps[f];
+				for (uint32_t p = 0; p < ResamplePhases; ++p) {
+					double frac = double(p) / ResamplePhases;
+					double sum = 0.0;
+					for (uint32_t t = 0; t < ResampleTaps; ++t) {
+						//distance from the sample position to this tap:
+						double x = double(t) - double(ResampleTaps / 2 - 1) - frac;
+						double sinc = (x == 0.0 ? 1.0 : std::sin(Pi * cutoff * x) / (Pi * cutoff * x));
+						double window = 0.42 + 0.5 * std::cos(Pi * x / HalfWidth) + 0.08 * std::cos(2.0 * Pi * x / HalfWidth); //Blackman
+						if (std::abs(x) >= HalfWidth) window = 0.0;
+						coefficients[f][p][t] = float(sinc * window);
+						sum += sinc * window;
+					}
+					//normalize so that each phase passes DC unchanged:
+					for (uint32_t t = 0; t < ResampleTaps; ++t) {
+						coefficients[f][p][t] = float(coefficients[f][p][t] / sum);
+					}
+				}
+			}
+		}
+		alignas(16) float coefficients[ResampleFilters][ResamplePhases][ResampleTaps];
+	};
+	ResampleTable const resample_table;
+
+	//pick the filter for a playback step:
+	inline float const *resample_filter(uint64_t step) {
+		float s = float(step) / 4294967296.0f;
+		uint32_t f = 0;
+		while (f + 1 < ResampleFilters && s > ResampleFilterSteps[f]) ++f;
+		return &resample_table.coefficients[f][0][0];
+	}
+
+	//position -> (integer sample, filter phase), rounding to the nearest phase:
+	inline void resample_position(uint64_t pos, uint32_t *sample, uint32_t *phase) {
+		uint64_t rounded = pos + (uint64_t(1) << (31 - ResamplePhaseBits));
+		*sample = uint32_t(rounded >> 32);
+		*phase = uint32_t(rounded >> (32 - ResamplePhaseBits)) & (ResamplePhases - 1);
+	}
+}
+
+void resample_mono_to_stereo_scalar(
+	float *dst, float const *src, uint32_t count,
+	uint64_t pos, uint64_t step,
+	float gain_l, float gain_r,
+	float step_l, float step_r
+) {
+	float const *filter = resample_filter(step);
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t sample, phase;
+		resample_position(pos, &sample, &phase);
+		float const *c = filter + phase * ResampleTaps;
+		float const *s = src + sample - (ResampleTaps / 2 - 1);
+		float value = 0.0f;
+		for (uint32_t t = 0; t < ResampleTaps; ++t) {
+			value += c[t] * s[t];
+		}
+		dst[2*i+0] += gain_l * value;
+		dst[2*i+1] += gain_r * value;
+		gain_l += step_l;
+		gain_r += step_r;
+		pos += step;
+	}
+}
+
+void resample_mono_to_stereo(
+	float *dst, float const *src, uint32_t count,
+	uint64_t pos, uint64_t step,
+	float gain_l, float gain_r,
+	float step_l, float step_r
+) {
+#if defined(MIX_KERNELS_SSE)
+	static_assert(ResampleTaps == 16, "SSE resampler is written for 16 taps");
+	float const *filter = resample_filter(step);
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t sample, phase;
+		resample_position(pos, &sample, &phase);
+		float const *c = filter + phase * ResampleTaps;
+		float const *s = src + sample - (ResampleTaps / 2 - 1);
+
+		//16-tap dot product, four taps at a time:
+		__m128 acc = _mm_mul_ps(_mm_load_ps(c + 0), _mm_loadu_ps(s + 0));
+		acc = _mm_add_ps(acc, _mm_mul_ps(_mm_load_ps(c + 4), _mm_loadu_ps(s + 4)));
+		acc = _mm_add_ps(acc, _mm_mul_ps(_mm_load_ps(c + 8), _mm_loadu_ps(s + 8)));
+		acc = _mm_add_ps(acc, _mm_mul_ps(_mm_load_ps(c + 12), _mm_loadu_ps(s + 12)));
+		//horizontal sum:
+		acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+		acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 0x55));
+		float value = _mm_cvtss_f32(acc);
+
+		dst[2*i+0] += gain_l * value;
+		dst[2*i+1] += gain_r * value;
+		gain_l += step_l;
+		gain_r += step_r;
+		pos += step;
+	}
+#else
+	resample_mono_to_stereo_scalar(dst, src, count, pos, step, gain_l, gain_r, step_l, step_r);
+#endif
+}
+
+void downmix_stereo_to_mono(float *dst, float const *src, uint32_t count) {
+	uint32_t i = 0;
+#if defined(MIX_KERNELS_SSE)
+	__m128 const half = _mm_set1_ps(0.5f);
+	for (; i + 4 <= count; i += 4) {
+		__m128 a = _mm_loadu_ps(src + 2*i); //l0 r0 l1 r1
+		__m128 b = _mm_loadu_ps(src + 2*i + 4); //l2 r2 l3 r3
+		__m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0)); //l0 l1 l2 l3
+		__m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1)); //r0 r1 r2 r3
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_add_ps(l, r), half));
+	}
+#endif
+	for (; i < count; ++i) {
+		dst[i] = (src[2*i+0] + src[2*i+1]) * 0.5f;
+	}
+}
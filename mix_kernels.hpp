@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+
+//Inner loops used by the audio mixer (see Sound.cpp).
+//These are kept in their own file so that they can be benchmarked (see mix-bench.cpp).
+
+//Add 'count' mono samples from 'src' into interleaved stereo (LRLR...) 'dst':
+// the left/right gains start at (gain_l, gain_r) and change by (step_l, step_r) after every sample.
+// uses SSE (or AVX, if compiled with it enabled) where available, and a plain loop otherwise.
+void mix_mono_to_stereo(
+	float *dst, float const *src, uint32_t count,
+	float gain_l, float gain_r,
+	float step_l, float step_r
+);
+
+//Same as above, but never uses SIMD; used as a reference by mix-bench:
+void mix_mono_to_stereo_scalar(
+	float *dst, float const *src, uint32_t count,
+	float gain_l, float gain_r,
+	float step_l, float step_r
+);
+
+//Equal-power 3D panning gains for 'count' sound sources, given structure-of-arrays:
+// source i is at (x[i], y[i], z[i]), gets half as loud at distance half_radius[i], and is scaled by volume[i];
+// the listener is at 'listener' with unit vector 'right' pointing to their right.
+// (sources exactly at the listener's position get sqrt(2) in both ears)
+// uses a polynomial sin/cos (error < 1e-6) and SSE where available.
+void compute_pan_gains_3D(
+	uint32_t count,
+	float const *x, float const *y, float const *z,
+	float const *half_radius, float const *volume,
+	float const listener[3], float const right[3],
+	float *left_gain, float *right_gain
+);
+
+//Same as above, but one source at a time with std::cos/std::sin; used as a reference by mix-bench:
+void compute_pan_gains_3D_reference(
+	uint32_t count,
+	float const *x, float const *y, float const *z,
+	float const *half_radius, float const *volume,
+	float const listener[3], float const right[3],
+	float *left_gain, float *right_gain
+);
+
+//Windowed-sinc resampling, for playing samples at other rates (see resample_mono_to_stereo):
+constexpr uint32_t const ResampleTaps = 16; //input samples read per output sample
+constexpr uint32_t const ResamplePhaseBits = 8;
+constexpr uint32_t const ResamplePhases = 1 << ResamplePhaseBits; //fractional positions the filter is tabulated at
+constexpr float const ResampleMaxStep = 4.0f; //fastest playback supported (input samples per output sample)
+
+//Add 'count' samples resampled from mono 'src' into interleaved stereo 'dst':
+// output sample k is interpolated at position (pos + k * step) in 'src', where pos and step are 32.32 fixed point,
+// from the ResampleTaps input samples around it -- src[p - ResampleTaps/2 + 1] to src[p + ResampleTaps/2] (p = position, rounded) --
+// which must all be readable. When step is more than 1.0 (pitching up), the filter's cutoff is lowered to limit aliasing.
+// gains work as in mix_mono_to_stereo. uses SSE where available.
+void resample_mono_to_stereo(
+	float *dst, float const *src, uint32_t count,
+	uint64_t pos, uint64_t step,
+	float gain_l, float gain_r,
+	float step_l, float step_r
+);
+
+//Same as above, but never uses SIMD; used as a reference by mix-bench:
+void resample_mono_to_stereo_scalar(
+	float *dst, float const *src, uint32_t count,
+	uint64_t pos, uint64_t step,
+	float gain_l, float gain_r,
+	float step_l, float step_r
+);
+
+//Average interleaved stereo (LRLR...) 'src' down to 'count' mono samples in 'dst':
+// gives exactly the same results as a plain (l + r) * 0.5f loop; uses SSE where available.
+void downmix_stereo_to_mono(float *dst, float const *src, uint32_t count);
@@ -0,0 +1,130 @@
+#include "pcm_cache.hpp"
+
+#include "data_path.hpp"
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <system_error>
+#include <thread>
+
+//cache entry layout:
+// Header
+// source path (header.path_size bytes, padded to a multiple of 16)
+// samples (header.count floats)
+
+namespace {
+	struct Header {
+		char magic[4] = {'p','c','m','0'};
+		uint32_t rate = 48000;
+		uint64_t source_size = 0;
+		int64_t source_time = 0;
+		uint64_t count = 0;
+		uint32_t path_size = 0;
+		uint32_t padding = 0;
+	};
+	static_assert(sizeof(Header) == 40, "Header should be packed.");
+
+	size_t samples_offset(Header const &header) {
+		return (sizeof(Header) + header.path_size + 15) / 16 * 16;
+	}
+
+	//size and modification time of the source file (false if it can't be read):
+	bool source_stats(std::string const &source, uint64_t *size, int64_t *time) {
+		std::error_code ec;
+		*size = std::filesystem::file_size(source, ec);
+		if (ec) return false;
+		auto modified = std::filesystem::last_write_time(source, ec);
+		if (ec) return false;
+		*time = int64_t(modified.time_since_epoch().count());
+		return true;
+	}
+
+	//cache entries are named by a hash of the source path:
+	// (the path itself is stored in the entry to catch collisions)
+	std::string entry_path(std::string const &source) {
+		std::string key = std::filesystem::absolute(source).lexically_normal().string();
+		uint64_t hash = 0xcbf29ce484222325ULL; //FNV-1a
+		for (char c : key) {
+			hash = (hash ^ uint8_t(c)) * 0x100000001b3ULL;
+		}
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.pcm", (unsigned long long)hash);
+		return data_path("pcm-cache") + "/" + name;
+	}
+}
+
+std::unique_ptr< MappedFile > pcm_cache_lookup(std::string const &source, float const **samples, size_t *count) {
+	assert(samples);
+	assert(count);
+
+	uint64_t size = 0;
+	int64_t time = 0;
+	if (!source_stats(source, &size, &time)) return nullptr;
+
+	std::string path = entry_path(source);
+	std::error_code ec;
+	if (!std::filesystem::exists(path, ec)) return nullptr;
+
+	std::unique_ptr< MappedFile > entry;
+	try {
+		entry.reset(new MappedFile(path));
+	} catch (std::exception &e) {
+		std::cerr << "WARNING: failed to open cached audio for '" << source << "': " << e.what() << std::endl;
+		return nullptr;
+	}
+
+	//check that the entry is complete and matches the source file:
+	Header header;
+	if (entry->size < sizeof(Header)) return nullptr;
+	std::memcpy(&header, entry->data, sizeof(Header));
+	if (std::memcmp(header.magic, Header().magic, 4) != 0) return nullptr;
+	if (header.rate != 48000 || header.source_size != size || header.source_time != time) return nullptr;
+	std::string key = std::filesystem::absolute(source).lexically_normal().string();
+	if (header.path_size != key.size() || entry->size < sizeof(Header) + key.size()) return nullptr;
+	if (std::memcmp(entry->data + sizeof(Header), key.data(), key.size()) != 0) return nullptr;
+	if (entry->size != samples_offset(header) + header.count * sizeof(float)) return nullptr;
+
+	*samples = reinterpret_cast< float const * >(entry->data + samples_offset(header));
+	*count = size_t(header.count);
+	return entry;
+}
+
+void pcm_cache_store(std::string const &source, std::vector< float > const &samples) {
+	Header header;
+	if (!source_stats(source, &header.source_size, &header.source_time)) return;
+	std::string key = std::filesystem::absolute(source).lexically_normal().string();
+	header.count = samples.size();
+	header.path_size = uint32_t(key.size());
+
+	std::string path = entry_path(source);
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+
+	//write to a temporary file and then move into place, so a partial entry is never read:
+	// (the temporary name includes the thread, since two loads of the same source can store at once)
+	std::string temp = path + ".tmp." + std::to_string(std::hash< std::thread::id >()(std::this_thread::get_id()));
+	{
+		std::ofstream out(temp, std::ios::binary);
+		out.write(reinterpret_cast< char const * >(&header), sizeof(header));
+		out.write(key.data(), key.size());
+		static char const zeros[16] = { 0 };
+		out.write(zeros, samples_offset(header) - sizeof(Header) - key.size());
+		out.write(reinterpret_cast< char const * >(samples.data()), samples.size() * sizeof(float));
+		out.close(); //(flushes, so errors writing the last of the data show up below)
+		if (!out) {
+			std::cerr << "WARNING: failed to write cached audio for '" << source << "' to '" << temp << "'." << std::endl;
+			std::filesystem::remove(temp, ec);
+			return;
+		}
+	}
+	std::filesystem::rename(temp, path, ec);
+	if (ec) {
+		std::cerr << "WARNING: failed to move cached audio for '" << source << "' into place: " << ec.message() << std::endl;
+		std::filesystem::remove(temp, ec);
+	}
+}
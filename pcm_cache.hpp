@@ -0,0 +1,28 @@
+#pragma once
+
+/*
+ * An on-disk cache of decoded audio, so that compressed sounds only need to
+ * be decoded the first time they are loaded.
+ *
+ * Each cache entry holds the 48kHz mono float samples decoded from one source
+ * file, along with the path, size, and modification time of that file.
+ * Entries whose source file has changed are ignored (and re-written).
+ *
+ * Cache entries are stored in the 'pcm-cache' folder next to the executable.
+ *
+ */
+
+#include "MappedFile.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+//Look up decoded samples for a source file:
+// returns nullptr if there is no up-to-date cache entry; otherwise returns the
+// mapped entry and sets *samples / *count to the samples inside it.
+std::unique_ptr< MappedFile > pcm_cache_lookup(std::string const &source, float const **samples, size_t *count);
+
+//Store decoded samples for a source file:
+// (failing to write the cache is not an error -- it just warns)
+void pcm_cache_store(std::string const &source, std::vector< float > const &samples);
@@ -2,8 +2,12 @@
 
 #include <iostream>
 #include <vector>
+#include <list>
 #include <stdexcept>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 
 //helper function that reads an array of structures preceded by a simple header:
 //Expected format:
@@ -41,6 +45,77 @@ void read_chunk(std::istream &from, std::string const &magic, std::vector< T > *
 }
 
 
+//Zero-copy versions of the above, for files already in memory (e.g., a MappedFile):
+
+//read-only view of the elements of a chunk:
+template< typename T >
+struct ChunkSpan {
+	T const *data = nullptr;
+	size_t count = 0;
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	T const *begin() const { return data; }
+	T const *end() const { return data + count; }
+	T const &operator[](size_t i) const { assert(i < count); return data[i]; }
+};
+
+//walks through chunks stored one after another in memory:
+struct ChunkReader {
+	ChunkReader(char const *data_, size_t size_) : data(data_), size(size_) { }
+
+	char const *data;
+	size_t size;
+	size_t offset = 0; //position of next chunk header
+
+	//chunks that aren't suitably aligned for their element type get copied here:
+	std::list< std::vector< std::max_align_t > > copies;
+};
+
+//read a chunk in the same format as read_chunk, but just point into memory instead of copying:
+// (spans stay valid while 'from' and the memory it refers to are alive)
+template< typename T >
+void read_chunk(ChunkReader &from, std::string const &magic, ChunkSpan< T > *to_) {
+	assert(to_);
+	auto &to = *to_;
+
+	struct ChunkHeader {
+		char magic[4] = {'\0', '\0', '\0', '\0'};
+		uint32_t size = 0;
+	};
+	static_assert(sizeof(ChunkHeader) == 8, "header is packed");
+
+	ChunkHeader header;
+	if (from.size - from.offset < sizeof(header)) {
+		throw std::runtime_error("Failed to read chunk header");
+	}
+	std::memcpy(&header, from.data + from.offset, sizeof(header));
+	if (std::string(header.magic,4) != magic) {
+		throw std::runtime_error("Unexpected magic number in chunk");
+	}
+
+	if (header.size % sizeof(T) != 0) {
+		throw std::runtime_error("Size of chunk not divisible by element size");
+	}
+	if (from.size - from.offset - sizeof(header) < header.size) {
+		throw std::runtime_error("Failed to read chunk data.");
+	}
+
+	char const *begin = from.data + from.offset + sizeof(header);
+	from.offset += sizeof(header) + header.size;
+
+	to.count = header.size / sizeof(T);
+	if (reinterpret_cast< uintptr_t >(begin) % alignof(T) == 0) {
+		to.data = reinterpret_cast< T const * >(begin);
+	} else {
+		//misaligned (e.g., after an odd-length string chunk), so fall back to copying:
+		from.copies.emplace_back((header.size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t));
+		std::memcpy(from.copies.back().data(), begin, header.size);
+		to.data = reinterpret_cast< T const * >(from.copies.back().data());
+	}
+}
+
+
 //helper function to write a chunk of data in the same format as read_chunk:
 template< typename T >
 void write_chunk(std::string const &magic, std::vector< T > const &from, std::ostream *to_) {
@@ -0,0 +1,111 @@
+#include "sample_codec.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+//---- Int16 ----
+
+void encode_int16(float const *src, size_t count, std::vector< int16_t > *dst_) {
+	assert(dst_);
+	auto &dst = *dst_;
+	dst.resize(count);
+	for (size_t i = 0; i < count; ++i) {
+		float v = std::max(-1.0f, std::min(1.0f, src[i]));
+		dst[i] = int16_t(std::lround(v * 32767.0f));
+	}
+}
+
+void decode_int16(int16_t const *src, uint32_t count, float *dst) {
+	//(simple loop that compilers vectorize)
+	for (uint32_t i = 0; i < count; ++i) {
+		dst[i] = float(src[i]) * (1.0f / 32767.0f);
+	}
+}
+
+//---- IMA-ADPCM ----
+
+namespace {
+	int16_t const StepTable[89] = {
+		7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+		50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+		253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+		1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+		3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+		12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+	};
+	int8_t const IndexTable[16] = {
+		-1, -1, -1, -1, 2, 4, 6, 8,
+		-1, -1, -1, -1, 2, 4, 6, 8
+	};
+
+	//decoder state update shared by the encoder and decoder (so they stay in sync):
+	inline void step(int32_t *predictor, int32_t *index, uint8_t code) {
+		int32_t s = StepTable[*index];
+		int32_t diff = s >> 3;
+		if (code & 4) diff += s;
+		if (code & 2) diff += s >> 1;
+		if (code & 1) diff += s >> 2;
+		if (code & 8) diff = -diff;
+		*predictor = std::max(-32768, std::min(32767, *predictor + diff));
+		*index = std::max(0, std::min(88, *index + IndexTable[code]));
+	}
+
+	inline int32_t to_int16(float v) {
+		return int32_t(std::lround(std::max(-1.0f, std::min(1.0f, v)) * 32767.0f));
+	}
+}
+
+void encode_adpcm(float const *src, size_t count, std::vector< uint8_t > *dst_) {
+	assert(dst_);
+	auto &dst = *dst_;
+	size_t blocks = (count + AdpcmBlockSamples - 1) / AdpcmBlockSamples;
+	dst.assign(blocks * AdpcmBlockBytes, 0);
+
+	int32_t index = 0; //step index carries over between blocks (it's stored in each header)
+	for (size_t b = 0; b < blocks; ++b) {
+		uint8_t *block = dst.data() + b * AdpcmBlockBytes;
+		size_t base = b * AdpcmBlockSamples;
+		auto sample = [&](uint32_t i) -> int32_t {
+			return (base + i < count ? to_int16(src[base + i]) : 0);
+		};
+
+		int32_t predictor = sample(0);
+		block[0] = uint8_t(predictor & 0xff);
+		block[1] = uint8_t((predictor >> 8) & 0xff);
+		block[2] = uint8_t(index);
+		block[3] = 0;
+
+		for (uint32_t i = 1; i < AdpcmBlockSamples; ++i) {
+			//quantize the difference the standard IMA way: a sign bit, then subtract step, step/2, step/4 in turn
+			// (this truncates toward zero rather than searching for the nearest code; step() then tracks the predictor exactly as the decoder will):
+			int32_t delta = sample(i) - predictor;
+			int32_t s = StepTable[index];
+			uint8_t code = 0;
+			if (delta < 0) { code = 8; delta = -delta; }
+			if (delta >= s) { code |= 4; delta -= s; }
+			if (delta >= (s >> 1)) { code |= 2; delta -= (s >> 1); }
+			if (delta >= (s >> 2)) { code |= 1; }
+			step(&predictor, &index, code);
+
+			uint32_t n = i - 1;
+			block[4 + n / 2] |= (n & 1 ? uint8_t(code << 4) : code);
+		}
+	}
+}
+
+void decode_adpcm_block(uint8_t const *block, float *dst) {
+	int32_t predictor = int16_t(uint16_t(block[0]) | (uint16_t(block[1]) << 8));
+	int32_t index = std::min< int32_t >(88, block[2]);
+	constexpr float Scale = 1.0f / 32767.0f;
+
+	dst[0] = float(predictor) * Scale;
+	uint8_t const *codes = block + 4;
+	for (uint32_t n = 0; n < AdpcmBlockSamples - 1; n += 2) {
+		uint8_t byte = codes[n / 2];
+		step(&predictor, &index, byte & 0xf);
+		dst[1 + n] = float(predictor) * Scale;
+		step(&predictor, &index, byte >> 4);
+		dst[2 + n] = float(predictor) * Scale;
+	}
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+/*
+ * Compact encodings for mono audio samples (see Sound::Sample::Format):
+ *  - Int16: 16-bit signed integers (2x smaller than float)
+ *  - ADPCM: IMA-ADPCM, 4 bits per sample, in fixed-size blocks (about 8x smaller than float)
+ *
+ * Encoding happens at load time; decoding is done by the mixer, a span or a block at a time.
+ *
+ */
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+//---- Int16 ----
+
+void encode_int16(float const *src, size_t count, std::vector< int16_t > *dst);
+void decode_int16(int16_t const *src, uint32_t count, float *dst);
+
+//---- IMA-ADPCM ----
+//each block starts with a 4-byte header (first sample as int16, step index, unused byte)
+// followed by (AdpcmBlockSamples-1) 4-bit codes, low nibble first.
+// (this is the same block layout as mono IMA-ADPCM '.wav' files with 256-byte blocks)
+
+constexpr uint32_t const AdpcmBlockBytes = 256;
+constexpr uint32_t const AdpcmBlockSamples = 1 + (AdpcmBlockBytes - 4) * 2; //505
+
+//encode samples as a sequence of blocks (the last block is padded with silence):
+void encode_adpcm(float const *src, size_t count, std::vector< uint8_t > *dst);
+
+//decode one whole block (AdpcmBlockSamples values) into dst:
+void decode_adpcm_block(uint8_t const *block, float *dst);
@@ -120,6 +120,8 @@ int main(int argc, char **argv) {
 				drawable.pipeline.type = mesh.type;
 				drawable.pipeline.start = mesh.start;
 				drawable.pipeline.count = mesh.count;
+				drawable.pipeline.min = mesh.min;
+				drawable.pipeline.max = mesh.max;
 
 			});
 		} catch (std::exception &e) {
@@ -130,6 +132,10 @@ int main(int argc, char **argv) {
 	}
 	if (!scene) {
 		usage = true;
+	} else {
+		//drawables are opaque and not instanced, so draw them in render-queue order:
+		// (the GL call counts shown in the corner reflect the sorting)
+		scene->sort_drawables = true;
 	}
 	if (usage) {
 		std::cerr << "Usage:\n\t" << argv[0] << " <path/to/scene.scene> [path/to/meshes.pnct]" << std::endl;